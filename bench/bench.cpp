@@ -1,3 +1,9 @@
+#include <algorithm>
+#include <cstring>
+#include <deque>
+#include <stdexcept>
+#include <vector>
+
 #include <benchmark/benchmark.h>
 #include <buffer_pool.hpp>
 #include <gsl.hpp>
@@ -6,17 +12,351 @@ using span_t = gsl::span<uint8_t>;
 
 uint8_t mem[4096] = {0};
 
+// Counts the costs of the operations on top of POLICY.
+template <class POLICY = default_pool_policy>
+struct counted : POLICY
+{
+    static constexpr bool count_costs = true;
+};
+
+// Enables the features which cost a check per operation even when unused.
+struct featured_policy : default_pool_policy
+{
+    static constexpr bool place_by_lifetime = true;
+    static constexpr bool wait_for_memory = true;
+    static constexpr bool watermarks = true;
+    static constexpr bool ready_lists = true;
+};
+
+// Reports the mgm_chunks searched per request, the longest search, the bytes
+// moved in the bookkeeping per request or release and the merges per release.
+template <class POOL>
+static void report_costs(benchmark::State& state, const POOL& pool)
+{
+    const auto costs = pool.costs();
+    const uint64_t ops = costs.requests + costs.releases;
+    state.counters["searched"] =
+        costs.requests ? double(costs.searched) / costs.requests : 0;
+    state.counters["max_searched"] = double(costs.max_searched);
+    state.counters["moved_bytes"] = ops ? double(costs.moved_bytes) / ops : 0;
+    state.counters["merges"] =
+        costs.releases ? double(costs.merges) / costs.releases : 0;
+}
 
+// Compare the policies for the costs of the features behind switches.
+template <class POLICY>
 static void BM_RequestRelease(benchmark::State& state)
 {
-    buffer_pool<span_t> pool(span_t(mem, sizeof(mem)));
+    buffer_pool<span_t, POLICY> pool(span_t(mem, sizeof(mem)));
     for (auto _ : state)
     {
         auto c = pool.request(state.range(0));
     }
     state.SetBytesProcessed(state.iterations() * state.range(0));
 }
-BENCHMARK(BM_RequestRelease)->Range(1, 1024);
+BENCHMARK_TEMPLATE(BM_RequestRelease, default_pool_policy)->Range(1, 1024);
+BENCHMARK_TEMPLATE(BM_RequestRelease, featured_policy)->Range(1, 1024);
+
+// Replaces Chunks between live ones, which searches for the free block and
+// merges it again on release. Compare the policies for the costs of the tag
+// accounting and of the canaries.
+template <class POLICY>
+static void BM_RequestReleaseBetweenLive(benchmark::State& state)
+{
+    using pool_t = buffer_pool<span_t, POLICY>;
+    static uint8_t memory[16 * 1024];
+    pool_t pool(span_t(memory, sizeof(memory)));
+    std::vector<typename pool_t::Chunk> live;
+    for (int i = 0; i < 64; ++i) live.push_back(pool.request(64, 1));
+
+    size_t i = 0;
+    for (auto _ : state)
+    {
+        auto& c = live[(i += 7) % live.size()];
+        c.release();
+        c = pool.request(64, 1);
+    }
+    state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK_TEMPLATE(BM_RequestReleaseBetweenLive, default_pool_policy);
+BENCHMARK_TEMPLATE(BM_RequestReleaseBetweenLive, tracking_pool_policy);
+BENCHMARK_TEMPLATE(BM_RequestReleaseBetweenLive, hardened_pool_policy);
+
+// Grows a vector of Chunks without reserving, which moves all Chunks on each
+// reallocation.
+static void BM_VectorGrowth(benchmark::State& state)
+{
+    buffer_pool<span_t> pool(span_t(mem, sizeof(mem)));
+    for (auto _ : state)
+    {
+        std::vector<buffer_pool<span_t>::Chunk> chunks;
+        for (int i = 0; i < state.range(0); ++i)
+            chunks.push_back(pool.request(1));
+        benchmark::DoNotOptimize(chunks.data());
+    }
+    state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+BENCHMARK(BM_VectorGrowth)->Range(8, 1024);
+
+// Passes Chunks through a queue like between a producer and a consumer.
+static void BM_QueueHandOff(benchmark::State& state)
+{
+    buffer_pool<span_t> pool(span_t(mem, sizeof(mem)));
+    std::deque<buffer_pool<span_t>::Chunk> queue;
+    for (int i = 0; i < state.range(0); ++i) queue.push_back(pool.request(1));
+
+    for (auto _ : state)
+    {
+        auto c = std::move(queue.front());
+        queue.pop_front();
+        queue.push_back(std::move(c));
+    }
+    state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_QueueHandOff)->Range(8, 1024);
+
+// A trace of Chunks with mixed sizes and lifetimes: short-lived small Chunks,
+// long-lived small Chunks replaced now and then, and large Chunks. Reports
+// the rate of large requests which could be satisfied and the costs.
+template <class POLICY>
+static void BM_MixedLifetimes(benchmark::State& state)
+{
+    using pool_t = buffer_pool<span_t, counted<POLICY>>;
+    static uint8_t memory[64 * 1024];
+    pool_t pool(span_t(memory, sizeof(memory)));
+
+    uint32_t seed = 1;
+    auto random = [&](uint32_t n) {
+        seed = seed * 1664525 + 1013904223;
+        return (seed >> 8) % n;
+    };
+
+    std::vector<typename pool_t::Chunk> longLived(192);
+    std::deque<typename pool_t::Chunk> shortLived;
+    size_t largeRequests = 0, largeSatisfied = 0;
+    for (auto _ : state)
+    {
+        try
+        {
+            shortLived.push_back(pool.request(16 + random(240)));
+            if (shortLived.size() > 32) shortLived.pop_front();
+            if (random(8) == 0)
+                longLived[random(longLived.size())] =
+                    pool.request(16 + random(240));
+        }
+        catch (const std::overflow_error&)
+        {
+            shortLived.clear();
+        }
+
+        if (random(16) == 0)
+        {
+            ++largeRequests;
+            try
+            {
+                auto large = pool.request(16384 + random(16384));
+                ++largeSatisfied;
+            }
+            catch (const std::overflow_error&)
+            {
+            }
+        }
+    }
+    state.counters["large_success"] =
+        largeRequests ? double(largeSatisfied) / largeRequests : 1.0;
+    report_costs(state, pool);
+}
+BENCHMARK_TEMPLATE(BM_MixedLifetimes, default_pool_policy);
+BENCHMARK_TEMPLATE(BM_MixedLifetimes, wilderness_pool_policy);
+
+// A long-running trace of short-lived read buffers and long-lived session
+// buffers, with and without the lifetime hint (argument 1 and 0). Reports
+// the failure rate, the fragmentation of the free memory, i.e. the share of
+// free memory not in the largest free block, and the costs.
+static void BM_LifetimeHint(benchmark::State& state)
+{
+    using pool_t = buffer_pool<span_t, counted<featured_policy>>;
+    static uint8_t memory[64 * 1024];
+    pool_t pool(span_t(memory, sizeof(memory)));
+    const auto sessionLifetime = state.range(0)
+                                     ? pool_t::lifetime::long_lived
+                                     : pool_t::lifetime::short_lived;
+
+    uint32_t seed = 1;
+    auto random = [&](uint32_t n) {
+        seed = seed * 1664525 + 1013904223;
+        return (seed >> 8) % n;
+    };
+
+    std::vector<pool_t::Chunk> sessions(96);
+    std::deque<pool_t::Chunk> reads;
+    size_t requests = 0, failures = 0;
+    double fragmentation = 0;
+    for (auto _ : state)
+    {
+        try
+        {
+            ++requests;
+            reads.push_back(pool.request(256 + random(4096)));
+            if (reads.size() > 12) reads.pop_front();
+            if (random(16) == 0)
+            {
+                ++requests;
+                sessions[random(sessions.size())] =
+                    pool.request(64 + random(256), 0, sessionLifetime);
+            }
+        }
+        catch (const std::overflow_error&)
+        {
+            ++failures;
+            reads.clear();
+        }
+        const size_t free = std::max<size_t>(pool.free_mem(), 1);
+        fragmentation += 1.0 - double(pool.largest_free()) / free;
+    }
+    state.counters["failure_rate"] = double(failures) / requests;
+    state.counters["fragmentation"] = fragmentation / state.iterations();
+    report_costs(state, pool);
+}
+BENCHMARK(BM_LifetimeHint)->Arg(0)->Arg(1);
+
+// Replaces random Chunks of a stable distribution of sizes, with the ready
+// lists enabled (argument 1) or not (argument 0). The pool is maintained
+// after every 64 requests as if it was idle then. A warm-up phase lets the
+// pool learn the sizes before measuring. Reports the hit rate of the ready
+// lists.
+static void BM_ReadyLists(benchmark::State& state)
+{
+    using pool_t = buffer_pool<span_t, featured_policy>;
+    static uint8_t memory[64 * 1024];
+    pool_t pool(span_t(memory, sizeof(memory)));
+    if (state.range(0)) pool.set_ready_lists(4, 16);
+
+    uint32_t seed = 1;
+    auto random = [&](uint32_t n) {
+        seed = seed * 1664525 + 1013904223;
+        return (seed >> 8) % n;
+    };
+    static const size_t sizes[] = {64, 64, 64, 64, 128, 128, 512, 1500};
+    std::vector<pool_t::Chunk> live(32);
+    auto step = [&] {
+        auto& c = live[random(live.size())];
+        c.release();
+        c = pool.request(sizes[random(8)]);
+    };
+
+    for (size_t i = 1; i <= 10000; ++i)
+    {
+        step();
+        if (i % 64 == 0) pool.maintain();
+    }
+    const auto warm = pool.ready_list_stats();
+
+    size_t i = 0;
+    for (auto _ : state)
+    {
+        step();
+        if (++i % 64 == 0)
+        {
+            state.PauseTiming();
+            pool.maintain();
+            state.ResumeTiming();
+        }
+    }
+
+    const auto stats = pool.ready_list_stats();
+    const auto hits = stats.hits - warm.hits;
+    const auto misses = stats.misses - warm.misses;
+    state.counters["hit_rate"] =
+        hits + misses ? double(hits) / (hits + misses) : 0;
+}
+BENCHMARK(BM_ReadyLists)->Arg(0)->Arg(1);
+
+// Replaces random Chunks of a few small sizes among many live ones, with
+// quick lists (argument 1) or without (argument 0). Reports the hit rate and
+// the costs.
+static void BM_QuickLists(benchmark::State& state)
+{
+    using pool_t = buffer_pool<span_t, counted<featured_policy>>;
+    static uint8_t memory[64 * 1024];
+    pool_t pool(span_t(memory, sizeof(memory)));
+    if (state.range(0)) pool.set_quick_lists(64, 32);
+
+    uint32_t seed = 1;
+    auto random = [&](uint32_t n) {
+        seed = seed * 1664525 + 1013904223;
+        return (seed >> 8) % n;
+    };
+    std::vector<pool_t::Chunk> live(512);
+    for (auto _ : state)
+    {
+        auto& c = live[random(live.size())];
+        c.release();
+        c = pool.request(16 * (1 + random(4)));
+    }
+    const auto stats = pool.ready_list_stats();
+    state.counters["hit_rate"] =
+        stats.hits + stats.misses
+            ? double(stats.hits) / (stats.hits + stats.misses)
+            : 0;
+    report_costs(state, pool);
+}
+BENCHMARK(BM_QuickLists)->Arg(0)->Arg(1);
+
+
+// Accumulates messages of 16 streams whose data arrives in segments of
+// random sizes, growing the buffer of a stream for each segment. A message
+// is complete at 2 KiB and its buffer is dropped.
+template <class APPEND>
+static void stream_accumulation(benchmark::State& state, APPEND append)
+{
+    uint32_t seed = 1;
+    auto random = [&](uint32_t n) {
+        seed = seed * 1664525 + 1013904223;
+        return (seed >> 8) % n;
+    };
+    static uint8_t segment[256];
+    for (auto _ : state)
+        append(random(16), segment, 1 + random(sizeof(segment)));
+    state.SetItemsProcessed(state.iterations());
+}
+
+static void BM_StreamAccumulation(benchmark::State& state)
+{
+    using pool_t = buffer_pool<span_t>;
+    static uint8_t memory[64 * 1024];
+    pool_t pool(span_t(memory, sizeof(memory)));
+    std::vector<pool_t::Chunk> streams(16);
+    stream_accumulation(state, [&](size_t i, const uint8_t* data, size_t n) {
+        auto& c = streams[i];
+        size_t size = 0;
+        if (!c.valid())
+        {
+            c = pool.request(n);
+        }
+        else
+        {
+            size = c.m_chunk.size();
+            c.resize(size + n);
+        }
+        std::memcpy(c.m_chunk.data() + size, data, n);
+        if (c.m_chunk.size() >= 2048) c.release();
+    });
+}
+BENCHMARK(BM_StreamAccumulation);
+
+static void BM_StreamAccumulationVector(benchmark::State& state)
+{
+    std::vector<std::vector<uint8_t>> streams(16);
+    stream_accumulation(state, [&](size_t i, const uint8_t* data, size_t n) {
+        auto& v = streams[i];
+        const size_t size = v.size();
+        v.resize(size + n);
+        std::memcpy(v.data() + size, data, n);
+        if (v.size() >= 2048) std::vector<uint8_t>().swap(v);
+    });
+}
+BENCHMARK(BM_StreamAccumulationVector);
 
 
 BENCHMARK_MAIN();
@@ -2,9 +2,279 @@
 #pragma once
 
 #include <algorithm>
+#include <atomic>
+#include <cassert>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <functional>
+#include <iterator>
+#include <limits>
+#include <mutex>
+#include <ostream>
 #include <stdexcept>
+#include <type_traits>
+#include <utility>
 #include <vector>
 
+// Annotations for AddressSanitizer, which are enabled automatically, and
+// Valgrind memcheck, which are enabled by defining BUFFER_POOL_VALGRIND.
+// They make memory which is not part of a Chunk inaccessible, so that
+// overflows between Chunks and uses of released Chunks are reported.
+#if defined(__SANITIZE_ADDRESS__)
+#define BUFFER_POOL_ASAN
+#elif defined(__has_feature)
+#if __has_feature(address_sanitizer)
+#define BUFFER_POOL_ASAN
+#endif
+#endif
+
+#ifdef BUFFER_POOL_ASAN
+#include <sanitizer/asan_interface.h>
+#define BUFFER_POOL_ASAN_POISON(addr, size) ASAN_POISON_MEMORY_REGION(addr, size)
+#define BUFFER_POOL_ASAN_UNPOISON(addr, size) \
+    ASAN_UNPOISON_MEMORY_REGION(addr, size)
+#else
+#define BUFFER_POOL_ASAN_POISON(addr, size)
+#define BUFFER_POOL_ASAN_UNPOISON(addr, size)
+#endif
+
+#ifdef BUFFER_POOL_VALGRIND
+#include <valgrind/memcheck.h>
+#define BUFFER_POOL_VALGRIND_NOACCESS(addr, size) \
+    VALGRIND_MAKE_MEM_NOACCESS(addr, size)
+#define BUFFER_POOL_VALGRIND_UNDEFINED(addr, size) \
+    VALGRIND_MAKE_MEM_UNDEFINED(addr, size)
+#define BUFFER_POOL_VALGRIND_DEFINED(addr, size) \
+    VALGRIND_MAKE_MEM_DEFINED(addr, size)
+#else
+#define BUFFER_POOL_VALGRIND_NOACCESS(addr, size)
+#define BUFFER_POOL_VALGRIND_UNDEFINED(addr, size)
+#define BUFFER_POOL_VALGRIND_DEFINED(addr, size)
+#endif
+
+// Linux USDT probes, which are enabled by defining BUFFER_POOL_USDT and
+// require <sys/sdt.h> of SystemTap. Each probe of the provider buffer_pool
+// (request, shrink, release and resize) receives the address and size of the
+// Chunk and the number of mgm_chunks searched. An untraced probe is a nop.
+#ifdef BUFFER_POOL_USDT
+#include <sys/sdt.h>
+#define BUFFER_POOL_PROBE(event, chunk, size, searched) \
+    DTRACE_PROBE3(buffer_pool, event, chunk, size, searched)
+#else
+#define BUFFER_POOL_PROBE(event, chunk, size, searched)
+#endif
+
+// Chunks do not depend on their address, so with clang they are passed in
+// registers and can be relocated by copying their bytes, if span_t allows it.
+#if defined(__has_cpp_attribute)
+#if __has_cpp_attribute(clang::trivial_abi)
+#define BUFFER_POOL_TRIVIAL_ABI [[clang::trivial_abi]]
+#endif
+#endif
+#ifndef BUFFER_POOL_TRIVIAL_ABI
+#define BUFFER_POOL_TRIVIAL_ABI
+#endif
+
+/**
+ * A mutex which does nothing. Used by buffer_pools which are only accessed by
+ * a single thread.
+ */
+struct null_mutex
+{
+    void lock() {}
+    bool try_lock() { return true; }
+    void unlock() {}
+};
+
+/**
+ * The operations reported to the tracing hook of a policy.
+ */
+enum class pool_event
+{
+    request,  // A Chunk was requested. Its address is nullptr if it failed.
+    shrink,   // A Chunk was shrunk from the back or the front.
+    release,  // A Chunk was released.
+    resize    // A Chunk was grown by Chunk::resize.
+};
+
+/**
+ * The default policy of a buffer_pool. It adds no overhead: Chunks are
+ * placed back to back and released memory is left untouched.
+ *
+ * A policy is a set of compile-time switches. Custom policies should derive
+ * from default_pool_policy and only override what they need.
+ */
+struct default_pool_policy
+{
+    // Number of canary bytes placed in front of and behind each Chunk.
+    static constexpr size_t guard_size = 0;
+
+    // The value the canary bytes are filled with.
+    static constexpr uint8_t guard_byte = 0xAB;
+
+    // If true, released memory is overwritten with poison_byte and checked
+    // for modifications before it is handed out again.
+    static constexpr bool poison = false;
+    static constexpr uint8_t poison_byte = 0xDD;
+
+    /**
+     * @brief corruption Called whenever a damaged canary or modified poison
+     * is detected.
+     * @param what A short description of the detected damage.
+     * @param chunk The first address of the affected Chunk or free block.
+     * @param size The size of the affected Chunk or free block.
+     */
+    static void corruption(const char* /*what*/, const void* /*chunk*/,
+                           size_t /*size*/)
+    {
+    }
+
+    // If true, the destructor of the buffer_pool reports all Chunks which
+    // have not been released to leaked().
+    static constexpr bool check_leaks = false;
+
+    /**
+     * @brief leaked Called by the destructor of the buffer_pool for each
+     * Chunk which was still alive.
+     * @param chunk The first address of the leaked Chunk.
+     * @param size The size of the leaked Chunk.
+     * @param tag The tag passed to buffer_pool::request.
+     * @param name The name of the tag or nullptr if it has none.
+     */
+    static void leaked(const void* /*chunk*/, size_t /*size*/, uint32_t /*tag*/,
+                       const char* /*name*/)
+    {
+    }
+
+    // Tags below max_tags are accounted and can be named and limited, see
+    // buffer_pool::usage. Higher tags are only shown in reports by number.
+    // The accounting takes 64 bytes for each tag up to the highest one used.
+    static constexpr size_t max_tags = 0;
+
+    // The mutex protecting the buffer_pool. The default is not threadsafe.
+    using mutex_t = null_mutex;
+
+    // By default, a request takes the free mgm_chunk at the highest address
+    // which fits and the unused memory at the tail only if none fits.
+    // Requests of at most small_request bytes take the free mgm_chunk at the
+    // lowest address instead, so small long-lived Chunks do not pin the
+    // memory next to the tail. Requests of at least large_request bytes take
+    // the tail first, which keeps the holes between Chunks for smaller ones.
+    static constexpr size_t small_request = 0;
+    static constexpr size_t large_request = std::numeric_limits<size_t>::max();
+
+    // The features below cost a check per request and release even when they
+    // are not used, so they are off by default.
+
+    // If true, long-lived Chunks are placed from the end of the memory, see
+    // buffer_pool::request. Otherwise the lifetime passed is ignored.
+    static constexpr bool place_by_lifetime = false;
+
+    // If true, requests can wait for memory, see buffer_pool::request_wait
+    // and buffer_pool::request_async.
+    static constexpr bool wait_for_memory = false;
+
+    // If true, the pool signals pressure, see
+    // buffer_pool::set_used_watermarks and
+    // buffer_pool::set_largest_free_watermarks.
+    static constexpr bool watermarks = false;
+
+    // If true, blocks can be kept ready for common sizes, see
+    // buffer_pool::set_ready_lists and buffer_pool::set_quick_lists.
+    static constexpr bool ready_lists = false;
+
+    // If true, each operation publishes the stats read by
+    // buffer_pool::stats_snapshot from other threads.
+    static constexpr bool publish_stats = false;
+
+    // If true, the costs of the operations are counted, see
+    // buffer_pool::costs.
+    static constexpr bool count_costs = false;
+
+    // If true, trace() is called for each operation.
+    static constexpr bool tracing = false;
+
+    /**
+     * @brief trace Called after each request, shrink, release and resize if
+     * tracing is true, under the lock of the buffer_pool. It must not call
+     * into the buffer_pool.
+     * @param event The operation.
+     * @param chunk The first address of the Chunk after the operation.
+     * @param size The size of the Chunk after the operation.
+     * @param searched The number of mgm_chunks inspected to find memory.
+     */
+    static void trace(pool_event /*event*/, const void* /*chunk*/,
+                      size_t /*size*/, size_t /*searched*/)
+    {
+    }
+};
+
+/**
+ * A policy for buffer_pools shared by several threads. All operations are
+ * serialized by a std::mutex and request_wait can block until another thread
+ * releases memory.
+ */
+struct threadsafe_pool_policy : default_pool_policy
+{
+    using mutex_t = std::mutex;
+    static constexpr bool wait_for_memory = true;
+};
+
+/**
+ * A policy preserving the unused memory at the tail (the "wilderness") for
+ * large requests when Chunks of mixed sizes and lifetimes share a
+ * buffer_pool. Derive from it to tune the thresholds.
+ */
+struct wilderness_pool_policy : default_pool_policy
+{
+    static constexpr size_t small_request = 256;
+    static constexpr size_t large_request = 4096;
+};
+
+/**
+ * A policy for staging and load tests. Chunks which are still alive when
+ * their buffer_pool is destroyed are reported with their size and tag, as
+ * their destructors will access the dead pool.
+ */
+struct tracking_pool_policy : default_pool_policy
+{
+    static constexpr bool check_leaks = true;
+    static constexpr size_t max_tags = 256;
+
+    static void leaked(const void* chunk, size_t size, uint32_t tag,
+                       const char* name)
+    {
+        std::fprintf(stderr,
+                     "buffer_pool: leaked chunk %p, %zu bytes, tag %u (%s)\n",
+                     chunk, size, tag, name != nullptr ? name : "unnamed");
+    }
+};
+
+/**
+ * A policy for debugging and for hardened production builds. Every Chunk is
+ * surrounded by canaries which are validated on shrink and release, released
+ * memory is poisoned and a detected corruption aborts the process with a
+ * message naming the offending Chunk. Leaked Chunks are reported like with
+ * the tracking_pool_policy.
+ */
+struct hardened_pool_policy : tracking_pool_policy
+{
+    static constexpr size_t guard_size = 8;
+    static constexpr bool poison = true;
+
+    static void corruption(const char* what, const void* chunk, size_t size)
+    {
+        std::fprintf(stderr, "buffer_pool: %s (chunk %p, %zu bytes)\n", what,
+                     chunk, size);
+        std::abort();
+    }
+};
+
 /**
  * A buffer_pool is a management entity for a range of memory.
  *
@@ -56,16 +326,187 @@
  *     auto bytesRead = read(fd, chunk.m_chunk.data());
  *     chunk.shrink(bytesRead);
  *
+ * The POLICY controls debugging aids at compile time. With the
+ * hardened_pool_policy every Chunk is surrounded by canary bytes and released
+ * memory is poisoned, which allows detecting overruns and writes to released
+ * Chunks. Use check_integrity() to validate the whole pool.
+ *
  */
-template <class SPAN>
+template <class SPAN, class POLICY = default_pool_policy>
 class buffer_pool
 {
 public:
     using span_t = SPAN;
     using pointer_t = typename span_t::pointer;
+    using policy_t = POLICY;
+    using mutex_t = typename POLICY::mutex_t;
+
+    // Tags are chosen by the user to mark the owner or purpose of a Chunk.
+    using tag_t = uint32_t;
+
+    /**
+     * @brief The tag_usage struct holds the memory accounting of one tag.
+     */
+    struct tag_usage
+    {
+        size_t used = 0;    // Bytes in Chunks with the tag.
+        size_t chunks = 0;  // Number of Chunks with the tag.
+        size_t peak = 0;    // Maximum of used.
+
+        size_t soft_quota = std::numeric_limits<size_t>::max();
+        size_t hard_quota = std::numeric_limits<size_t>::max();
+
+        size_t soft_exceeded = 0;  // Requests exceeding the soft quota.
+        size_t rejected = 0;       // Requests rejected by the hard quota.
+    };
+
+    /**
+     * @brief The quota_exceeded exception is thrown by request if a Chunk
+     * would exceed the hard quota of its tag.
+     */
+    struct quota_exceeded : std::overflow_error
+    {
+        quota_exceeded() : std::overflow_error("quota exceeded") {}
+    };
+
+    // Called with the tag and its used bytes if a request exceeds the soft
+    // quota of the tag.
+    using soft_quota_handler_t = std::function<void(tag_t, size_t)>;
+
+    // Called with true when a watermark signals that the buffer_pool comes
+    // under pressure and with false when it has recovered.
+    using pressure_handler_t = std::function<void(bool)>;
+
+    /**
+     * @brief The block_info struct describes one mgm_chunk by offsets, so it
+     * can be stored independent of the address of the memory. A block holding
+     * a Chunk includes its canaries.
+     */
+    struct block_info
+    {
+        uint64_t offset;  // Offset of the first byte in the memory.
+        uint64_t size;    // Size in bytes.
+        uint32_t tag;     // Tag of the Chunk, if in use.
+        uint32_t in_use;  // 1 if the block holds a Chunk, 0 if it is free.
+        uint64_t used;    // Size of the Chunk, if in use.
+    };
+
+    /**
+     * @brief The compact_chunk struct is a handle of 8 bytes for the memory
+     * of a Chunk, for keeping large numbers of Chunks in queues. It does not
+     * own the memory and is only meaningful together with its buffer_pool,
+     * see compact(), expand() and data().
+     */
+    struct compact_chunk
+    {
+        uint32_t offset;  // Offset of the data in the memory.
+        uint32_t size;    // Size of the data in bytes.
+    };
+
+    /**
+     * @brief The ready_stats struct shows how well the ready lists match the
+     * requests, see set_ready_lists.
+     */
+    struct ready_stats
+    {
+        uint64_t hits;    // Requests served from a ready list.
+        uint64_t misses;  // Requests which found no ready block.
+        size_t blocks;    // Blocks in the ready lists.
+        size_t bytes;     // Bytes in the ready lists.
+    };
+
+    /**
+     * @brief The stats struct is a consistent view of the state of a
+     * buffer_pool, see stats_snapshot.
+     */
+    struct stats
+    {
+        uint64_t size;           // Size of the memory.
+        uint64_t used;           // Bytes used by Chunks, including canaries.
+        uint64_t used_chunks;    // Number of Chunks.
+        uint64_t unused_chunks;  // Number of free mgm_chunks, a measure of
+                                 // fragmentation.
+        uint64_t requests;       // Chunks handed out.
+        uint64_t failures;       // Requests which could not be satisfied
+                                 // immediately.
+        uint64_t releases;       // Chunks released.
+    };
+
+    /**
+     * @brief The cost_stats struct shows how expensive the operations of a
+     * buffer_pool are, see costs. Long searches call for a different POLICY
+     * or ready lists, many moved bytes and merges for a larger buffer_pool.
+     */
+    struct cost_stats
+    {
+        static constexpr size_t buckets = 16;
+
+        uint64_t requests;      // Requests searching for memory.
+        uint64_t searched;      // mgm_chunks inspected by the requests.
+        uint64_t max_searched;  // Most mgm_chunks inspected by a request.
+
+        // Requests by the number of mgm_chunks inspected: 0, 1, 2-3, 4-7,
+        // ...; the last bucket also counts all longer searches.
+        uint64_t search_histogram[buckets];
+
+        // Bytes of mgm_chunks shifted by inserting and erasing mgm_chunks.
+        uint64_t moved_bytes;
+
+        uint64_t releases;  // Chunks released.
+        uint64_t merges;    // mgm_chunks merged by releases.
+    };
+
+    // The expected lifetime of a Chunk, see request.
+    enum class lifetime
+    {
+        short_lived,
+        long_lived
+    };
+
+    struct Chunk;
+
+    // Called with the Chunk requested by request_async.
+    using request_handler_t = std::function<void(Chunk)>;
+
+    // Identifies a request of request_async waiting for memory, see cancel.
+    using waiter_id = uint64_t;
 
 private:
-    const span_t m_memory;
+    // Canary bytes in front of and behind each Chunk. The mgm_chunk of a
+    // Chunk starts at the front canary.
+    static constexpr size_t guard = POLICY::guard_size;
+
+    // Under AddressSanitizer, blocks are rounded up to whole shadow granules
+    // and at least one granule behind the data of each Chunk is poisoned, so
+    // overflows into the next Chunk are reported even without canaries. The
+    // padding lies between the data and the back canary and is not counted
+    // as used memory.
+#ifdef BUFFER_POOL_ASAN
+    static constexpr size_t granule = 8;
+    static constexpr size_t redzone = guard < granule ? granule - guard : 0;
+#else
+    static constexpr size_t granule = 1;
+    static constexpr size_t redzone = 0;
+#endif
+
+    // The size of the block holding a Chunk of size bytes.
+    static constexpr size_t block_size(size_t size)
+    {
+        return (size + 2 * guard + redzone + granule - 1) / granule * granule;
+    }
+
+    // Are operations traced by the POLICY or USDT probes?
+#ifdef BUFFER_POOL_USDT
+    static constexpr bool tracing = true;
+#else
+    static constexpr bool tracing = POLICY::tracing;
+#endif
+
+    // Are the mgm_chunks inspected by requests counted?
+    static constexpr bool count_search = tracing || POLICY::count_costs;
+
+    // The managed memory. Only sub-pools grow or shrink it.
+    span_t m_memory;
 
     /**
      * @brief The mgm_chunk struct is used internally by the buffer_pool to
@@ -74,18 +515,139 @@ private:
     struct mgm_chunk
     {
         pointer_t m_first;  // Points to the first address in the mgm_chunk.
-        bool m_inUse;       // Is the mgm_chunk in use by a Chunk?
+        bool m_inUse;       // Is it used by a Chunk or kept in a ready list?
+        bool m_held;        // Released, but not yet available for reuse.
+        tag_t m_tag;        // The tag of the Chunk using the mgm_chunk.
 
-        mgm_chunk(pointer_t first, bool inUse = true)
-            : m_first(first), m_inUse(inUse)
+        mgm_chunk(pointer_t first, bool inUse = true, tag_t tag = 0)
+            : m_first(first), m_inUse(inUse), m_held(false), m_tag(tag)
         {
         }
     };
 
+    // Can the mgm_chunk be merged and reused?
+    static bool is_free(const mgm_chunk& c) { return !c.m_inUse && !c.m_held; }
+
     using chunkVec_t = std::vector<mgm_chunk>;
     chunkVec_t m_chunks;
 
+    struct tag_info
+    {
+        const char* m_name = nullptr;
+        tag_usage m_usage;
+    };
+
+    // Names and accounting of the tags, indexed by tag.
+    std::vector<tag_info> m_tags;
+
+    soft_quota_handler_t m_softQuotaHandler;
+
+    size_t m_used = 0;  // The memory used by Chunks, including canaries.
+    size_t m_usedChunks = 0;  // The number of mgm_chunks in use.
+
+    // Operation counts for stats_snapshot.
+    uint64_t m_requests = 0;
+    uint64_t m_failures = 0;
+    uint64_t m_releases = 0;
+
+    // The stats published after each operation, word by word, protected by
+    // a sequence lock: m_statsSequence is odd while they are written.
+    static constexpr size_t stats_words = sizeof(stats) / sizeof(uint64_t);
+    static_assert(sizeof(stats) == stats_words * sizeof(uint64_t),
+                  "stats must consist of uint64_t");
+    std::atomic<uint32_t> m_statsSequence{0};
+    std::atomic<uint64_t> m_statsWords[stats_words] = {};
+
+    /**
+     * @brief The watermark struct describes a signal with hysteresis. It is
+     * raised when a value crosses m_raise and cleared when it crosses m_clear
+     * back.
+     */
+    struct watermark
+    {
+        size_t m_raise = 0;
+        size_t m_clear = 0;
+        bool m_raised = false;
+        pressure_handler_t m_handler;
+
+        bool enabled() const { return static_cast<bool>(m_handler); }
+
+        // Raises or clears the signal for a value which rises towards
+        // pressure.
+        void update_rising(size_t value)
+        {
+            if (!m_raised && value >= m_raise)
+                set(true);
+            else if (m_raised && value <= m_clear)
+                set(false);
+        }
+
+        // Raises or clears the signal for a value which falls towards
+        // pressure.
+        void update_falling(size_t value)
+        {
+            if (!m_raised && value < m_raise)
+                set(true);
+            else if (m_raised && value >= m_clear)
+                set(false);
+        }
+
+        void set(bool raised)
+        {
+            m_raised = raised;
+            m_handler(raised);
+        }
+    };
+
+    watermark m_usedMark;
+    watermark m_largestFreeMark;
+
     pointer_t m_last;  // The first unused address in the managed memory.
+    pointer_t m_top;   // The first address of the long-lived mgm_chunks.
+
+    bool m_holdReleased = false;  // Hold released mgm_chunks back?
+
+    // Approximate counts of the most common block sizes requested recently,
+    // maintained with the space-saving algorithm.
+    struct size_count
+    {
+        size_t m_size;
+        uint32_t m_count;
+    };
+    std::vector<size_count> m_histogram;
+    uint32_t m_samples = 0;
+
+    // A block kept in a ready list. Its mgm_chunk stays in use, so neither
+    // the search for free memory nor merging touch it, and it is handed out
+    // without looking the mgm_chunk up unless the tag differs.
+    struct ready_block
+    {
+        pointer_t m_first;
+        tag_t m_tag;  // The tag of its mgm_chunk.
+    };
+
+    // Blocks of one block size, ready to be handed out as they are.
+    struct ready_list
+    {
+        size_t m_size;
+        std::vector<ready_block> m_blocks;
+        bool m_quick;     // Fed by releases only, so maintain keeps it.
+        uint32_t m_hits;  // Hits since the last maintain, for the sampling.
+    };
+    std::vector<ready_list> m_readyLists;
+    size_t m_readySizes = 0;  // Number of block sizes with ready lists.
+    size_t m_readyDepth = 0;  // Number of blocks per ready list.
+    size_t m_quickMax = 0;    // Size of the largest Chunk in quick lists.
+    size_t m_quickDepth = 0;  // Number of released blocks per ready list.
+    size_t m_quickSizes = 0;  // Number of block sizes with quick lists.
+    uint64_t m_readyHits = 0;
+    uint64_t m_readyMisses = 0;
+
+    size_t m_searched = 0;  // mgm_chunks inspected by the current request.
+    cost_stats m_costs{};
+
+    mutable mutex_t m_mutex;
+    using lock_t = std::unique_lock<mutex_t>;
 
 public:
     /**
@@ -98,7 +660,7 @@ public:
      * The lifetime of buffer_pool *must* exceed the lifetime of all Chunks
      * it manages.
      */
-    struct Chunk
+    struct BUFFER_POOL_TRIVIAL_ABI Chunk
     {
         // A span which points to the memory that can be used by the Chunk.
         span_t m_chunk;
@@ -118,47 +680,105 @@ public:
         Chunk(Chunk& orig) = delete;
         Chunk& operator=(const Chunk& orig) = delete;
 
-        // Chunks can be moved.
-        Chunk(Chunk&& orig)
+        // Chunks can be moved. The moved-from Chunk becomes invalid.
+        Chunk(Chunk&& orig) noexcept
+            : m_chunk(orig.m_chunk), m_pool(orig.m_pool)
         {
-            using std::swap;
-            swap(orig.m_chunk, m_chunk);
-            swap(orig.m_pool, m_pool);
+            orig.m_chunk = span_t();
+            orig.m_pool = nullptr;
         }
 
+        // Releases the memory of this Chunk before taking over orig's. Like
+        // release, this may call the handlers of waiting requests, so it is
+        // not noexcept.
         Chunk& operator=(Chunk&& orig)
         {
-            using std::swap;
-            swap(orig.m_chunk, m_chunk);
-            swap(orig.m_pool, m_pool);
+            if (this != &orig)
+            {
+                release();
+                m_chunk = orig.m_chunk;
+                m_pool = orig.m_pool;
+                orig.m_chunk = span_t();
+                orig.m_pool = nullptr;
+            }
             return *this;
         }
 
         ~Chunk() { release(); }
 
         /**
-         * @brief shrink Shrink the Chunk.
+         * @brief shrink Shrink the Chunk. May call the handlers of waiting
+         * requests, see release.
          * @param newSize The target size of the Chunk. Must be smaller than
          * or equal to m_chunk.size().
          */
         void shrink(const size_t newSize)
         {
             assert(newSize <= m_chunk.size());
-            if (newSize != m_chunk.size())
-            {
-                m_chunk = span_t(m_chunk.begin(), newSize);
-                m_pool->resize(*this);
-            }
+            if (newSize != m_chunk.size()) m_pool->resize(*this, newSize);
+        }
+
+        /**
+         * @brief resize Changes the size of the Chunk like realloc, keeping
+         * its data. The cheapest possible way is chosen: The Chunk shrinks in
+         * place, grows in place into free memory behind it, grows into free
+         * memory in front of it by moving its data, or is moved to a new
+         * block.
+         * @param newSize The target size of the Chunk.
+         * @throw std::overflow_error Not enough continuous memory, or the
+         * Chunk would have to be moved while requests wait for memory. The
+         * Chunk is left unchanged.
+         * @throw quota_exceeded The Chunk would exceed the hard quota of its
+         * tag.
+         */
+        void resize(const size_t newSize)
+        {
+            if (newSize <= m_chunk.size())
+                shrink(newSize);
+            else
+                m_pool->grow(*this, newSize);
+        }
+
+        /**
+         * @brief consume Removes data from the front of the Chunk, e.g. a
+         * parsed header, and returns its memory to the buffer_pool.
+         * @param n The number of bytes to remove. Must be smaller than
+         * m_chunk.size().
+         */
+        void consume(const size_t n)
+        {
+            assert(n < m_chunk.size());
+            if (n != 0) m_pool->consume(*this, n);
+        }
+
+        /**
+         * @brief split Splits the Chunk into two Chunks without copying, e.g.
+         * to pass the messages of one read to different owners. Each of them
+         * can be released independently. Requires a POLICY without canaries,
+         * as there is no room for them between the Chunks.
+         * @param offset The size of the Chunk, which keeps the data in front
+         * of offset. Must be greater than 0 and smaller than m_chunk.size().
+         * @return The Chunk owning the data from offset on.
+         */
+        Chunk split(const size_t offset)
+        {
+            static_assert(guard == 0, "split requires a POLICY without canaries");
+            assert(offset > 0 && offset < m_chunk.size());
+            return m_pool->split(*this, offset);
         }
 
         /**
          * @brief release Releases the memory managed by the Chunk. The chunk
-         * becomes invalid after being released.
+         * becomes invalid after being released. If the memory satisfies
+         * waiting requests, their handlers (see request_async) are called
+         * before release returns. The same holds for shrink and the
+         * destructor.
          */
         void release()
         {
             if (m_pool != nullptr) m_pool->release(*this);
             m_chunk = span_t();
+            m_pool = nullptr;
         }
 
         /**
@@ -167,14 +787,126 @@ public:
          * @return True if it is valid, false otherwise.
          */
         bool valid() const { return m_pool != nullptr; }
+
+        /**
+         * @brief detach Gives up the ownership of the memory without
+         * releasing it. The memory stays in use until a Chunk adopts it
+         * again, e.g. after restoring a persistent buffer_pool.
+         */
+        void detach()
+        {
+            m_chunk = span_t();
+            m_pool = nullptr;
+        }
     };
 
     // Chunk needs to call some private methods on buffer_bool, nobody else
     // should call, so make it a friend.
     friend struct Chunk;
 
-    buffer_pool(span_t memory) : m_memory(memory), m_last(std::begin(m_memory))
+private:
+    /**
+     * @brief The waiter struct is a request waiting for memory to be
+     * released. Blocking requests wait for m_result to become valid,
+     * asynchronous ones pass the Chunk to m_handler.
+     */
+    struct waiter
+    {
+        size_t m_size;
+        tag_t m_tag;
+        Chunk* m_result;
+        request_handler_t m_handler;
+        waiter_id m_id;
+    };
+
+    // Waiting requests in FIFO order.
+    std::deque<waiter> m_waiters;
+    waiter_id m_lastWaiter = 0;
+    std::condition_variable_any m_available;
+
+    // The Chunk of the parent buffer_pool holding the memory of a sub-pool.
+    Chunk m_parent;
+
+public:
+    buffer_pool(span_t memory)
+        : m_memory(memory),
+          m_last(std::begin(m_memory)),
+          m_top(std::end(m_memory))
+    {
+        poison(m_last, std::end(m_memory));
+        publish_stats();
+    }
+
+    /**
+     * @brief buffer_pool Creates a buffer_pool restoring the bookkeeping
+     * previously obtained by for_each_block for the same memory. Blocks in
+     * use have no Chunks; use adopt to create them.
+     * @param memory The memory holding the data of the blocks.
+     * @param first The first block, ordered by offset.
+     * @param last Behind the last block.
+     * @throw std::invalid_argument The blocks do not describe the memory.
+     */
+    template <class IT>
+    buffer_pool(span_t memory, IT first, IT last)
+        : m_memory(memory),
+          m_last(std::begin(m_memory)),
+          m_top(std::end(m_memory))
+    {
+        for (; first != last; ++first)
+        {
+            const block_info& b = *first;
+            if (b.offset != offset(m_last) || b.size == 0 ||
+                b.size > static_cast<size_t>(
+                             std::distance(m_last, std::end(m_memory))) ||
+                (b.in_use && (b.size < 2 * guard || b.used == 0 ||
+                              b.used > b.size - 2 * guard)))
+                throw std::invalid_argument("blocks do not match the memory");
+
+            m_chunks.emplace_back(m_last, b.in_use != 0, b.tag);
+            const pointer_t first = m_last;
+            m_last += b.size;
+            if (b.in_use)
+            {
+                m_used += b.used + 2 * guard;
+                if (accounted(b.tag))
+                {
+                    tag_usage& usage = tag_entry(b.tag).m_usage;
+                    usage.used += b.used;
+                    usage.peak = std::max(usage.peak, usage.used);
+                    ++usage.chunks;
+                }
+                ++m_usedChunks;
+                mark_noaccess(first, first + guard);
+                mark_noaccess(first + guard + b.used, m_last);
+            }
+        }
+        // Free memory may have been modified, e.g. before a crash.
+        for (auto it = begin(m_chunks); it != end(m_chunks); ++it)
+            if (!it->m_inUse) poison(it->m_first, block_end(it));
+        poison(m_last, std::end(m_memory));
+        coalesce();
+        publish_stats();
+    }
+
+    /**
+     * @brief buffer_pool Creates a sub-pool managing the memory of a Chunk of
+     * a parent buffer_pool. The sub-pool owns the Chunk and releases it when
+     * it is destroyed, which returns all of its memory to the parent at once.
+     * If the sub-pool runs out of memory, it grows the Chunk in place if the
+     * memory behind it is free in the parent. shrink_to_fit() returns unused
+     * memory to the parent.
+     * The parent must outlive the sub-pool.
+     * @param parent A valid Chunk of the parent buffer_pool.
+     */
+    explicit buffer_pool(Chunk&& parent)
+        : m_memory(parent.m_chunk),
+          m_last(std::begin(m_memory)),
+          m_top(std::end(m_memory)),
+          m_parent(std::move(parent))
     {
+        assert(m_parent.valid());
+        poison(m_last, std::end(m_memory));
+        publish_stats();
     }
 
     // Buffer_pools cannot be copied ...
@@ -186,113 +918,1793 @@ public:
     buffer_pool& operator=(buffer_pool&& other) = delete;
 
     /// All Chunks managed by this buffer_pool *must* have been
-    /// released/destroyed before destroying the pool!
-    ~buffer_pool() = default;
+    /// released/destroyed before destroying the pool! If the POLICY checks for
+    /// leaks, all Chunks still alive are reported.
+    /// The memory is made accessible again for its owner.
+    ~buffer_pool()
+    {
+        if (POLICY::check_leaks)
+        {
+            const auto ready = ready_blocks();
+            for (auto it = begin(m_chunks); it != end(m_chunks); ++it)
+                if (in_use(it, ready))
+                    POLICY::leaked(it->m_first + guard, chunk_size(it),
+                                   it->m_tag, name_of(it->m_tag));
+        }
+        mark_defined(std::begin(m_memory), std::end(m_memory));
+    }
 
     /**
      * @brief request Creates a new Chunk managed by this buffer_pool.
      * @param size The size of the requested Chunk. Must be smaller than the
      * size of the buffer_pool. If no Chunk of a suitable size can be found,
      * an exception is thrown.
+     * @param tag A tag identifying the owner or purpose of the Chunk. It is
+     * shown in reports about live or leaked Chunks and the Chunk is accounted
+     * to it if it is below the max_tags of the POLICY.
+     * @param life The expected lifetime of the Chunk. If the POLICY places
+     * by lifetime, short-lived Chunks are placed from the beginning of the
+     * memory, long-lived ones from its end, so that long-lived Chunks do not
+     * fragment the memory of short-lived ones. If one end is full, holes at
+     * the other one are used.
      * @throw std::overflow_error Not enough continuous memory left in
-     * buffer_pool to satisfy request.
+     * buffer_pool to satisfy request. While requests of request_wait or
+     * request_async are waiting for memory, every request throws, however
+     * much memory is free, so it does not overtake them. The same holds for
+     * requests of a tag while a request of that tag waits for its quota.
+     * @throw quota_exceeded The Chunk would exceed the hard quota of the tag.
      * @return A Chunk which manages the memory of the requested size.
      *
      */
-    Chunk request(size_t size)
+    Chunk request(size_t size, tag_t tag = 0,
+                  lifetime life = lifetime::short_lived)
     {
-        assert(size < m_memory.size());
-        pointer_t begin = nullptr;
-
-        // Search from the back of the vector to create kind of a
-        // fragmented stack and try to keep the reorganizing of the
-        // vector to a minimum as opposed to erasing/inserting at the front.
-        auto rit = std::find_if(
-            std::rbegin(m_chunks), std::rend(m_chunks),
-            [&](auto c) { return !c.m_inUse && this->size(c) >= size; });
+        lock_t lock(m_mutex);
+        check_quota(size, tag);
 
-        if (rit == rend(m_chunks))
+        if (count_search) m_searched = 0;
+        Chunk chunk = overtakes(tag) ? Chunk() : allocate(size, tag, life);
+        trace_request(chunk, size);
+        if (!chunk.valid())
         {
-            // Check if rest of memory is large enough
-            const auto rest = std::distance(m_last, m_memory.end());
-            assert(rest >= 0);
-            if (static_cast<size_t>(rest) < size)
-                throw std::overflow_error("out of memory");
+            ++m_failures;
+            publish_stats();
+            throw std::overflow_error("out of memory");
+        }
+        return chunk;
+    }
+
+    /**
+     * @brief request_wait Creates a new Chunk like request, but if there is
+     * not enough memory, waits for other threads to release it. Requests are
+     * served in FIFO order, so large requests are not starved by small ones.
+     * Requires a threadsafe POLICY with wait_for_memory.
+     * @param size The size of the requested Chunk.
+     * @param timeout The maximum time to wait.
+     * @param tag The tag of the Chunk.
+     * @throw quota_exceeded The Chunk exceeds the hard quota of the tag by
+     * itself.
+     * @throw std::overflow_error The Chunk can never fit into the
+     * buffer_pool.
+     * @return The requested Chunk or an invalid Chunk if the timeout expired.
+     */
+    template <class Rep, class Period>
+    Chunk request_wait(size_t size,
+                       const std::chrono::duration<Rep, Period>& timeout,
+                       tag_t tag = 0)
+    {
+        static_assert(!std::is_same<mutex_t, null_mutex>::value,
+                      "request_wait requires a threadsafe POLICY");
+        static_assert(POLICY::wait_for_memory,
+                      "request_wait requires a POLICY with wait_for_memory");
+        const auto deadline = std::chrono::steady_clock::now() + timeout;
+
+        lock_t lock(m_mutex);
+        check_satisfiable(size, tag);
 
-            // No chunk of suitable size found - create new one
-            begin = m_last;
-            m_chunks.emplace_back(begin);
-            m_last = begin + size;
+        Chunk chunk;
+        if (!overtakes(tag) && fits_quota(size, tag))
+            chunk = allocate(size, tag);
+        if (chunk.valid())
+        {
+            trace_request(chunk, size);
+            return chunk;
         }
-        else
+
+        ++m_failures;
+        publish_stats();
+        m_waiters.push_back(waiter{size, tag, &chunk, nullptr, ++m_lastWaiter});
+        m_available.wait_until(lock, deadline,
+                               [&chunk] { return chunk.valid(); });
+
+        if (!chunk.valid())
         {
-            // Re-use existing chunk.
-            auto it = --rit.base();
-            begin = it->m_first;
-            it->m_inUse = true;
+            // Timed out. Leave the queue, the following requests might fit.
+            m_waiters.erase(std::find_if(
+                begin(m_waiters), end(m_waiters),
+                [&chunk](const waiter& w) { return w.m_result == &chunk; }));
+            serve_waiters(lock);
+        }
+        return chunk;
+    }
+
+    /**
+     * @brief request_async Creates a new Chunk like request and passes it to
+     * the handler. If there is not enough memory, the request is queued and
+     * the handler is called by the shrink or release which makes enough
+     * memory available. Requests are served in FIFO order, except that a
+     * request waiting for the quota of its tag does not hold up the requests
+     * of other tags. Until then, all calls of request throw
+     * std::overflow_error.
+     * The handler is called synchronously, by request_async itself or inside
+     * Chunk::shrink, Chunk::release or the destructor of a Chunk, e.g. while
+     * the stack of another callback unwinds. It is not called under the lock
+     * of the buffer_pool, so it may use the buffer_pool, and it must not
+     * throw. Requests still waiting when the buffer_pool is destroyed are
+     * dropped. Requires a POLICY with wait_for_memory.
+     * @param size The size of the requested Chunk.
+     * @param handler The function receiving the Chunk.
+     * @param tag The tag of the Chunk.
+     * @throw quota_exceeded The Chunk exceeds the hard quota of the tag by
+     * itself.
+     * @throw std::overflow_error The Chunk can never fit into the
+     * buffer_pool.
+     * @return The id of the queued request, which can be passed to cancel,
+     * or 0 if the handler has already been called.
+     */
+    waiter_id request_async(size_t size, request_handler_t handler,
+                            tag_t tag = 0)
+    {
+        static_assert(POLICY::wait_for_memory,
+                      "request_async requires a POLICY with wait_for_memory");
+        lock_t lock(m_mutex);
+        check_satisfiable(size, tag);
 
-            // If the new chunk doesn't fix exactly, we need to create a new one
-            // for the memory that is left to the beginning of the next Chunk.
-            if (this->size(*it) != size)
-                m_chunks.insert(next(it), mgm_chunk(begin + size, false));
+        Chunk chunk;
+        if (!overtakes(tag) && fits_quota(size, tag))
+            chunk = allocate(size, tag);
+
+        if (chunk.valid())
+        {
+            trace_request(chunk, size);
+            lock.unlock();
+            handler(std::move(chunk));
+            return 0;
         }
 
-        return Chunk(begin, size, *this);
+        ++m_failures;
+        publish_stats();
+        m_waiters.push_back(
+            waiter{size, tag, nullptr, std::move(handler), ++m_lastWaiter});
+        return m_lastWaiter;
     }
 
     /**
-     * @brief used_mem Calculates the amount of used memory in the buffer_pool.
-     * @return The amount of memory used in Chunks.
+     * @brief cancel Withdraws a request of request_async which is still
+     * waiting for memory, e.g. because the object its handler refers to is
+     * destroyed. The requests behind it may fit now, so their handlers may be
+     * called before cancel returns.
+     * @param id The id returned by request_async.
+     * @return True if the request was withdrawn, false if its handler has
+     * already been called or is being called by another thread.
      */
-    size_t used_mem() const
+    bool cancel(waiter_id id)
     {
-        return std::accumulate(begin(m_chunks), end(m_chunks), size_t(0),
-                               [this](const auto& a, const auto& b) {
-                                   return a + (b.m_inUse ? this->size(b) : 0);
-                               });
+        lock_t lock(m_mutex);
+        const auto it =
+            std::find_if(begin(m_waiters), end(m_waiters),
+                         [id](const waiter& w) { return w.m_id == id; });
+        if (it == end(m_waiters)) return false;
+
+        m_waiters.erase(it);
+        serve_waiters(lock);
+        return true;
     }
 
     /**
-     * @brief free_mem Calculates the remaining free memory in the buffer_pool.
-     * @return The amount of free memory in the buffer_pool. Not continuous.
+     * @brief num_waiters The number of requests waiting for memory.
      */
-    size_t free_mem() const { return size() - used_mem(); }
+    size_t num_waiters() const
+    {
+        lock_t lock(m_mutex);
+        return m_waiters.size();
+    }
+
+private:
+    // Creates a new Chunk, which is invalid if there is not enough memory.
+    Chunk allocate(size_t size, tag_t tag,
+                   lifetime life = lifetime::short_lived)
+    {
+        Chunk chunk = place_chunk(size, tag, life);
+        if (chunk.valid()) update_pressure();
+        return chunk;
+    }
+
+    // Creates a new Chunk like allocate, but leaves the watermarks and the
+    // stats to the caller.
+    Chunk place_chunk(size_t size, tag_t tag, lifetime life)
+    {
+        assert(size < m_memory.size() || m_parent.valid());
+        const size_t blockSize = block_size(size);
+        if (count_search) m_searched = 0;
+
+        pointer_t begin = nullptr;
+        if (POLICY::ready_lists &&
+            (m_readyDepth != 0 || !m_readyLists.empty()))
+            begin = pop_ready(blockSize, tag);
+        if (begin == nullptr)
+        {
+            if (POLICY::ready_lists && m_readyDepth != 0) sample(blockSize, 1);
+            auto it = place(blockSize, size, life);
+            if (POLICY::ready_lists && it == end(m_chunks) && flush_ready())
+                it = place(blockSize, size, life);
+            if (it != end(m_chunks))
+            {
+                begin = it->m_first;
+                it->m_tag = tag;
+            }
+        }
+        record_search();
+        if (begin == nullptr) return Chunk();
+
+        m_used += size + 2 * guard;
+        ++m_usedChunks;
+        ++m_requests;
+        if (accounted(tag))
+        {
+            tag_usage& usage = tag_entry(tag).m_usage;
+            usage.used += size;
+            usage.peak = std::max(usage.peak, usage.used);
+            ++usage.chunks;
+            if (usage.used > usage.soft_quota)
+            {
+                ++usage.soft_exceeded;
+                if (m_softQuotaHandler) m_softQuotaHandler(tag, usage.used);
+            }
+        }
+
+        write_guards(begin, begin + blockSize);
+        mark_undefined(begin + guard, begin + guard + size);
+        return Chunk(begin + guard, size, *this);
+    }
+
+    // Finds memory for a block, marks it as in use and returns it. Returns
+    // end(m_chunks) if there is not enough continuous memory.
+    typename chunkVec_t::iterator place(size_t blockSize, size_t size,
+                                        lifetime life)
+    {
+        pointer_t begin = nullptr;
+        const auto rest = std::distance(m_last, m_top);
+        assert(rest >= 0);
+        const bool longLived =
+            POLICY::place_by_lifetime && life == lifetime::long_lived;
+        const auto top = first_top();
+        auto it = end(m_chunks);
+        if (longLived)
+        {
+            // Search from the unused memory towards the end of the memory.
+            it = find_free(top, end(m_chunks), blockSize, true);
+        }
+        else if (size < POLICY::large_request ||
+                 static_cast<size_t>(rest) < blockSize)
+        {
+            it = find_free(std::begin(m_chunks), top, blockSize,
+                           size <= POLICY::small_request);
+        }
+
+        if (it == end(m_chunks) && static_cast<size_t>(rest) < blockSize &&
+            !grow_memory(blockSize - rest))
+        {
+            // Use a hole at the other end of the memory.
+            it = longLived
+                     ? find_free(std::begin(m_chunks), top, blockSize, false)
+                     : find_free(top, end(m_chunks), blockSize, true);
+            if (it == end(m_chunks)) return it;
+        }
+
+        if (it == end(m_chunks))
+        {
+            // No chunk of suitable size found - create new one from the
+            // unused memory, inserted between the short-lived and the
+            // long-lived mgm_chunks.
+            if (longLived)
+            {
+                m_top -= blockSize;
+                begin = m_top;
+            }
+            else
+            {
+                begin = m_last;
+                m_last = begin + blockSize;
+            }
+            check_poison(begin, begin + blockSize);
+            return insert_block(first_top(), begin);
+        }
+
+        // Re-use existing chunk.
+        begin = it->m_first;
+        check_poison(begin, begin + blockSize);
+        it->m_inUse = true;
+
+        // If the new chunk doesn't fix exactly, we need to create a new one
+        // for the memory that is left to the beginning of the next Chunk.
+        if (begin + blockSize != block_end(it))
+            it = prev(insert_block(next(it), begin + blockSize, false));
+        return it;
+    }
+
+    // Counts requests of a block size in m_histogram.
+    void sample(size_t blockSize, uint32_t count)
+    {
+        auto it = std::find_if(
+            begin(m_histogram), end(m_histogram),
+            [=](const size_count& c) { return c.m_size == blockSize; });
+        if (it == end(m_histogram))
+        {
+            if (m_histogram.size() < 4 * m_readySizes + 8)
+            {
+                m_histogram.push_back(size_count{blockSize, 0});
+                it = prev(end(m_histogram));
+            }
+            else
+            {
+                // Replace the least common size, taking over its count.
+                it = std::min_element(begin(m_histogram), end(m_histogram),
+                                      [](const size_count& a,
+                                         const size_count& b) {
+                                          return a.m_count < b.m_count;
+                                      });
+                it->m_size = blockSize;
+            }
+        }
+        it->m_count += count;
+
+        // Let old requests fade out.
+        m_samples += count;
+        if (m_samples >= 1024)
+        {
+            m_samples = 0;
+            for (auto& c : m_histogram) c.m_count /= 2;
+        }
+    }
+
+    // Takes a block from the ready list of blockSize for a Chunk of tag.
+    // Returns nullptr if there is none. Hits are counted in the list rather
+    // than sampled, to keep them cheap.
+    pointer_t pop_ready(size_t blockSize, tag_t tag)
+    {
+        for (auto& list : m_readyLists)
+        {
+            if (list.m_size != blockSize || list.m_blocks.empty()) continue;
+
+            const ready_block block = list.m_blocks.back();
+            list.m_blocks.pop_back();
+            check_poison(block.m_first, block.m_first + blockSize);
+            if (block.m_tag != tag) find_block(block.m_first)->m_tag = tag;
+            ++list.m_hits;
+            ++m_readyHits;
+            return block.m_first;
+        }
+        ++m_readyMisses;
+        return nullptr;
+    }
+
+    // Returns the blocks of a ready list to the free memory, leaving the
+    // merging to the caller.
+    void empty_ready(ready_list& list)
+    {
+        for (const ready_block& block : list.m_blocks)
+            find_block(block.m_first)->m_inUse = false;
+        list.m_blocks.clear();
+    }
+
+    // Returns the blocks of all ready lists to the free memory.
+    // Returns false if there were none.
+    bool flush_ready()
+    {
+        bool flushed = false;
+        for (auto& list : m_readyLists)
+        {
+            flushed = flushed || !list.m_blocks.empty();
+            empty_ready(list);
+        }
+        if (flushed) coalesce();
+        return flushed;
+    }
+
+    // The sorted first addresses of the blocks in the ready lists, for walks
+    // over all mgm_chunks.
+    std::vector<pointer_t> ready_blocks() const
+    {
+        std::vector<pointer_t> blocks;
+        for (const auto& list : m_readyLists)
+            for (const ready_block& block : list.m_blocks)
+                blocks.push_back(block.m_first);
+        std::sort(begin(blocks), end(blocks));
+        return blocks;
+    }
+
+    // Is the mgm_chunk used by a Chunk rather than kept in a ready list?
+    static bool in_use(typename chunkVec_t::const_iterator it,
+                       const std::vector<pointer_t>& ready)
+    {
+        return it->m_inUse &&
+               !std::binary_search(begin(ready), end(ready), it->m_first);
+    }
+
+    // Finds a free mgm_chunk of at least blockSize bytes in [first, last).
+    // Returns end(m_chunks) if there is none.
+    typename chunkVec_t::iterator find_free(
+        typename chunkVec_t::iterator first,
+        typename chunkVec_t::iterator last, size_t blockSize, bool fromFront)
+    {
+        const auto fits = [&](typename chunkVec_t::const_iterator it) {
+            if (count_search) ++m_searched;
+            return is_free(*it) &&
+                   static_cast<size_t>(std::distance(
+                       it->m_first, block_end(it))) >= blockSize;
+        };
+
+        if (fromFront)
+        {
+            for (auto it = first; it != last; ++it)
+                if (fits(it)) return it;
+            return end(m_chunks);
+        }
+
+        // Search from the back of the vector to create kind of a
+        // fragmented stack and try to keep the reorganizing of the
+        // vector to a minimum as opposed to erasing/inserting at the front.
+        for (auto it = last; it != first;)
+            if (fits(--it)) return it;
+        return end(m_chunks);
+    }
+
+    // The first long-lived mgm_chunk, found by binary search.
+    typename chunkVec_t::iterator first_top()
+    {
+        if (!POLICY::place_by_lifetime || m_top == std::end(m_memory))
+            return end(m_chunks);
+        return std::partition_point(
+            begin(m_chunks), end(m_chunks),
+            [&](const mgm_chunk& c) { return c.m_first < m_top; });
+    }
+
+    // Is the mgm_chunk the last short-lived one, next to the unused memory?
+    bool at_tail(typename chunkVec_t::const_iterator it) const
+    {
+        const auto n = next(it);
+        if (!POLICY::place_by_lifetime) return n == end(m_chunks);
+        return it->m_first < m_top && (n == end(m_chunks) || n->m_first >= m_top);
+    }
+
+    // Grows the memory of a sub-pool by at least extra bytes. Tries to double
+    // the memory first to keep the number of growths low.
+    bool grow_memory(size_t extra)
+    {
+        // Long-lived mgm_chunks are at the end, so the memory cannot grow.
+        if (!m_parent.valid() || m_top != std::end(m_memory)) return false;
+
+        const size_t size = m_memory.size();
+        if (!m_parent.m_pool->extend(m_parent, size + std::max(extra, size)) &&
+            !m_parent.m_pool->extend(m_parent, size + extra))
+            return false;
+
+        m_memory = m_parent.m_chunk;
+        m_top = std::end(m_memory);
+        poison(std::begin(m_memory) + size, std::end(m_memory));
+        return true;
+    }
+
+    // Grows a Chunk in place into the free memory behind it, unless that
+    // overtakes waiting requests.
+    bool extend(Chunk& chunk, size_t newSize)
+    {
+        lock_t lock(m_mutex);
+        const auto it = find_chunk(chunk);
+        assert(it != end(m_chunks));
+        assert(newSize >= chunk.m_chunk.size());
+
+        if (overtakes(it->m_tag) || !grows_in_place() ||
+            !fits_quota(newSize - chunk.m_chunk.size(), it->m_tag) ||
+            free_behind(it) < block_extra(it, newSize))
+            return false;
+
+        grow_block(it, chunk, newSize, 0);
+        update_pressure();
+        return true;
+    }
+
+    // Grows a Chunk for Chunk::resize.
+    void grow(Chunk& chunk, size_t newSize)
+    {
+        lock_t lock(m_mutex);
+        auto it = find_chunk(chunk);
+        assert(it != end(m_chunks));
+
+        check_guards(it);
+        check_quota(newSize - chunk.m_chunk.size(), it->m_tag);
+
+        // Like request, growing in place or by moving must not overtake
+        // waiting requests.
+        if (overtakes(it->m_tag)) throw std::overflow_error("out of memory");
+        const size_t extra = block_extra(it, newSize);
+
+        const size_t behind = free_behind(it);
+        if (grows_in_place() && behind >= extra)
+        {
+            grow_block(it, chunk, newSize, 0);
+        }
+        else if (!m_holdReleased && behind + free_in_front(it) >= extra)
+        {
+            grow_block(it, chunk, newSize, extra - behind);
+        }
+        else
+        {
+            // Move the data to a new block and release the old one.
+            // The old block is unaccounted first and the watermarks are only
+            // updated afterwards, so neither the quotas nor the watermarks
+            // see both blocks in use.
+            const span_t old = chunk.m_chunk;
+            const tag_t tag = it->m_tag;
+            const lifetime life = it->m_first >= m_top ? lifetime::long_lived
+                                                       : lifetime::short_lived;
+            unaccount(tag, old.size(), true);
+            Chunk moved = place_chunk(newSize, tag, life);
+            if (!moved.valid())
+            {
+                reaccount(tag, old.size());
+                throw std::overflow_error("out of memory");
+            }
+            std::memcpy(moved.m_chunk.data(), old.data(), old.size());
+            ++m_releases;
+            if (POLICY::count_costs) ++m_costs.releases;
+            free_block(find_chunk(chunk), old);
+
+            chunk.m_chunk = moved.m_chunk;
+            moved.m_chunk = span_t();
+            moved.m_pool = nullptr;
+            update_pressure();
+            trace(pool_event::resize, chunk.m_chunk.data(), newSize, 0);
+            trace(pool_event::release, old.data(), old.size(), 0);
+            return;
+        }
+        update_pressure();
+        trace(pool_event::resize, chunk.m_chunk.data(), newSize, 0);
+    }
+
+    // Removes the first n bytes of a Chunk for Chunk::consume.
+    void consume(Chunk& chunk, size_t n)
+    {
+        lock_t lock(m_mutex);
+        auto it = find_chunk(chunk);
+        assert(it != end(m_chunks));
+
+        check_guards(it);
+        unaccount(it->m_tag, n, false);
+
+        // The new front canary overwrites the last bytes removed.
+        const pointer_t first = it->m_first;
+        if (m_holdReleased)
+            mark_noaccess(first, first + n);
+        else
+            poison(first, first + n);
+        chunk.m_chunk = span_t(chunk.m_chunk.data() + n, chunk.m_chunk.size() - n);
+        it->m_first += n;
+        write_guards(it->m_first, block_end(it));
+
+        // Keep the memory like a released block, or return it to the unused
+        // memory, merge it with the free mgm_chunk in front or insert a new
+        // one.
+        if (m_holdReleased)
+            hold_block(it, first);
+        else if (first == m_top)
+            m_top = it->m_first;
+        else if (it == begin(m_chunks) || !is_free(*prev(it)))
+            insert_block(it, first, false);
+
+        update_pressure();
+        trace(pool_event::shrink, chunk.m_chunk.data(), chunk.m_chunk.size(),
+              0);
+        serve_waiters(lock);
+    }
+
+    // Splits a Chunk for Chunk::split.
+    Chunk split(Chunk& chunk, size_t offset)
+    {
+        lock_t lock(m_mutex);
+        const auto it = find_chunk(chunk);
+        assert(it != end(m_chunks));
+
+        const pointer_t data = chunk.m_chunk.data();
+        const size_t size = chunk.m_chunk.size();
+        const tag_t tag = it->m_tag;
+        insert_block(next(it), data + offset, true, tag);
+        if (accounted(tag)) ++m_tags[tag].m_usage.chunks;
+        ++m_usedChunks;
+
+        // The second part is counted and traced like a request, which
+        // needed no search, so its release is balanced.
+        ++m_requests;
+        if (count_search) m_searched = 0;
+        record_search();
+        publish_stats();
+
+        chunk.m_chunk = span_t(data, offset);
+        Chunk part(data + offset, size - offset, *this);
+        trace(pool_event::shrink, data, offset, 0);
+        trace_request(part, part.m_chunk.size());
+        return part;
+    }
+
+    // While released memory is held back, the last checkpoint may refer to
+    // the data and canaries of a block. Growing it behind overwrites its
+    // back canary, growing it in front moves its data, so it is moved to a
+    // new block instead.
+    bool grows_in_place() const { return !m_holdReleased || guard == 0; }
+
+    // The free memory directly behind an mgm_chunk.
+    size_t free_behind(typename chunkVec_t::const_iterator it) const
+    {
+        if (at_tail(it)) return std::distance(m_last, m_top);
+        const auto n = next(it);
+        return n != end(m_chunks) && is_free(*n)
+                   ? std::distance(n->m_first, block_end(n))
+                   : 0;
+    }
+
+    // The free memory directly in front of an mgm_chunk.
+    size_t free_in_front(typename chunkVec_t::const_iterator it) const
+    {
+        if (it->m_first == m_top) return std::distance(m_last, m_top);
+        return it != begin(m_chunks) && is_free(*prev(it))
+                   ? std::distance(prev(it)->m_first, it->m_first)
+                   : 0;
+    }
+
+    // The bytes the block of a Chunk must grow by to hold newSize bytes.
+    size_t block_extra(typename chunkVec_t::const_iterator it,
+                       size_t newSize) const
+    {
+        const size_t blockSize = std::distance(it->m_first, block_end(it));
+        return std::max(block_size(newSize), blockSize) - blockSize;
+    }
+
+    // Grows the block of a Chunk to hold newSize bytes, taking front bytes of
+    // the free memory in front of it and the rest of the free memory behind
+    // it. If the block grows to the front, the data is moved.
+    void grow_block(typename chunkVec_t::iterator it, Chunk& chunk,
+                    size_t newSize, size_t front)
+    {
+        const size_t size = chunk.m_chunk.size();
+        const size_t extra = block_extra(it, newSize);
+        const size_t back = extra - front;
+        if (back != 0)
+        {
+            const auto nextIt = next(it);
+            if (at_tail(it))
+            {
+                check_poison(m_last, m_last + back);
+                m_last += back;
+            }
+            else
+            {
+                check_poison(nextIt->m_first, nextIt->m_first + back);
+                if (nextIt->m_first + back == block_end(nextIt))
+                    erase_block(nextIt);
+                else
+                    nextIt->m_first += back;
+            }
+        }
+
+        const pointer_t data = chunk.m_chunk.data();
+        pointer_t newData = data;
+        if (front != 0)
+        {
+            const pointer_t first = it->m_first - front;
+            check_poison(first, it->m_first);
+            if (it->m_first == m_top)
+                m_top = first;
+            else if (prev(it)->m_first == first)
+                it = erase_block(prev(it));
+            it->m_first = first;
+
+            // The old front canary becomes part of the Chunk.
+            newData = first + guard;
+            mark_undefined(newData, data);
+            std::memmove(newData, data, size);
+        }
+
+        // The old back canary and padding become part of the Chunk.
+        const pointer_t last = block_end(it);
+        if (data + size < newData + newSize)
+            mark_undefined(data + size, newData + newSize);
+        mark_noaccess(newData + newSize, last);
+        chunk.m_chunk = span_t(newData, newSize);
+        write_guards(it->m_first, last);
+
+        m_used += newSize - size;
+        if (accounted(it->m_tag))
+        {
+            tag_usage& usage = m_tags[it->m_tag].m_usage;
+            usage.used += newSize - size;
+            usage.peak = std::max(usage.peak, usage.used);
+        }
+    }
+
+    bool fits_quota(size_t size, tag_t tag) const
+    {
+        return !accounted(tag) || tag >= m_tags.size() ||
+               m_tags[tag].m_usage.used + size <= m_tags[tag].m_usage.hard_quota;
+    }
+
+    void check_quota(size_t size, tag_t tag)
+    {
+        if (!fits_quota(size, tag))
+        {
+            ++m_tags[tag].m_usage.rejected;
+            throw quota_exceeded();
+        }
+    }
+
+    // Rejects waiting for requests which can never be satisfied.
+    void check_satisfiable(size_t size, tag_t tag)
+    {
+        if (accounted(tag) && tag < m_tags.size() &&
+            size > m_tags[tag].m_usage.hard_quota)
+        {
+            ++m_tags[tag].m_usage.rejected;
+            throw quota_exceeded();
+        }
+        if (block_size(size) >= capacity())
+            throw std::overflow_error("request exceeds the buffer_pool");
+    }
+
+    // The memory a sub-pool can grow to is limited by the root buffer_pool,
+    // whose memory never changes.
+    size_t capacity() const
+    {
+        return m_parent.valid() ? m_parent.m_pool->capacity() : m_memory.size();
+    }
+
+    // Would a request of the tag overtake a waiting request? Requests wait
+    // behind those waiting for memory and those of their own tag waiting for
+    // its quota. The waiters which fit their quota wait for memory.
+    bool overtakes(tag_t tag) const
+    {
+        return POLICY::wait_for_memory && !m_waiters.empty() &&
+               std::any_of(begin(m_waiters), end(m_waiters),
+                           [this, tag](const waiter& w) {
+                               return w.m_tag == tag ||
+                                      fits_quota(w.m_size, w.m_tag);
+                           });
+    }
+
+    // Hands out memory to the waiting requests in FIFO order. Must be called
+    // with the lock held, which is released.
+    void serve_waiters(lock_t& lock)
+    {
+        if (POLICY::wait_for_memory && !m_waiters.empty()) serve_queue(lock);
+    }
+
+    void serve_queue(lock_t& lock)
+    {
+        std::vector<std::pair<request_handler_t, Chunk>> served;
+        bool notify = false;
+
+        // A request exceeding the quota of its tag only holds up the
+        // requests of that tag behind it.
+        std::vector<tag_t> blocked;
+        for (auto it = begin(m_waiters); it != end(m_waiters);)
+        {
+            if (std::find(begin(blocked), end(blocked), it->m_tag) !=
+                    end(blocked) ||
+                !fits_quota(it->m_size, it->m_tag))
+            {
+                blocked.push_back(it->m_tag);
+                ++it;
+                continue;
+            }
+
+            Chunk chunk = allocate(it->m_size, it->m_tag);
+            if (!chunk.valid()) break;
+            trace_request(chunk, it->m_size);
+
+            if (it->m_result != nullptr)
+            {
+                *it->m_result = std::move(chunk);
+                notify = true;
+            }
+            else
+            {
+                served.emplace_back(std::move(it->m_handler), std::move(chunk));
+            }
+            it = m_waiters.erase(it);
+        }
+        lock.unlock();
+
+        if (notify) m_available.notify_all();
+        for (auto& s : served) s.first(std::move(s.second));
+    }
+
+public:
+    /**
+     * @brief used_mem The amount of used memory in the buffer_pool. Runs in
+     * O(1).
+     * @return The amount of memory used in Chunks.
+     */
+    size_t used_mem() const
+    {
+        lock_t lock(m_mutex);
+        return m_used;
+    }
+
+    /**
+     * @brief free_mem The remaining free memory in the buffer_pool. Runs in
+     * O(1).
+     * @return The amount of free memory in the buffer_pool. Not continuous.
+     */
+    size_t free_mem() const { return size() - used_mem(); }
+
+    /**
+     * @brief largest_free Searches the largest continuous free memory, which
+     * is the largest Chunk that can be requested. Runs in O(n).
+     * @return The size of the largest free block in bytes.
+     */
+    size_t largest_free() const
+    {
+        lock_t lock(m_mutex);
+        return find_largest_free();
+    }
+
+private:
+    size_t find_largest_free() const
+    {
+        size_t largest = std::distance(m_last, m_top);
+        for (auto it = begin(m_chunks); it != end(m_chunks); ++it)
+            if (is_free(*it))
+                largest = std::max<size_t>(
+                    largest, std::distance(it->m_first, block_end(it)));
+        // The largest Chunk whose block fits.
+        largest = largest / granule * granule;
+        return largest > 2 * guard + redzone ? largest - 2 * guard - redzone
+                                             : 0;
+    }
+
+public:
+    /**
+     * @brief set_used_watermarks Signals pressure based on the used memory.
+     * The handler is called with true when used_mem() reaches high and with
+     * false when it falls to low again. It is called from request, shrink
+     * and release and must not throw or call into the buffer_pool. To signal
+     * an event loop, the handler can e.g. write to an eventfd. Requires a
+     * POLICY with watermarks.
+     * @param high The used memory signalling pressure.
+     * @param low The used memory signalling recovery. Must not exceed high.
+     * @param handler The function to be called. An empty function disables
+     * the watermarks.
+     */
+    void set_used_watermarks(size_t high, size_t low, pressure_handler_t handler)
+    {
+        static_assert(POLICY::watermarks,
+                      "set_used_watermarks requires a POLICY with watermarks");
+        assert(low <= high);
+        lock_t lock(m_mutex);
+        set_watermark(m_usedMark, high, low, std::move(handler));
+    }
+
+    /**
+     * @brief set_largest_free_watermarks Signals pressure based on the
+     * largest free block. The handler is called with true when
+     * largest_free() falls below low and with false when it reaches high
+     * again. As largest_free(), this costs O(n) per request, shrink and
+     * release. The handler must not throw or call into the buffer_pool.
+     * Requires a POLICY with watermarks.
+     * @param low The largest free block signalling pressure.
+     * @param high The largest free block signalling recovery. Must not be
+     * smaller than low.
+     * @param handler The function to be called. An empty function disables
+     * the watermarks.
+     */
+    void set_largest_free_watermarks(size_t low, size_t high,
+                                     pressure_handler_t handler)
+    {
+        static_assert(
+            POLICY::watermarks,
+            "set_largest_free_watermarks requires a POLICY with watermarks");
+        assert(low <= high);
+        lock_t lock(m_mutex);
+        set_watermark(m_largestFreeMark, low, high, std::move(handler));
+    }
+
+    /**
+     * @brief under_pressure Tests if any of the watermarks signals pressure.
+     */
+    bool under_pressure() const
+    {
+        lock_t lock(m_mutex);
+        return m_usedMark.m_raised || m_largestFreeMark.m_raised;
+    }
+
+    /**
+     * @brief size The size of the memory assigned to the buffer_bool.
+     * @return The size in bytes.
+     */
+    size_t size() const
+    {
+        lock_t lock(m_mutex);
+        return m_memory.size();
+    }
+
+    /**
+     * @brief footprint The memory a Chunk takes in a buffer_pool, including
+     * its canaries and, under AddressSanitizer, its padding and redzone.
+     * @param size The size of the Chunk.
+     * @return The size in bytes.
+     */
+    static constexpr size_t footprint(size_t size) { return block_size(size); }
+
+    /**
+     * @brief shrink_to_fit Returns the unused memory at the end of a sub-pool
+     * to its parent. Does nothing for other buffer_pools.
+     */
+    void shrink_to_fit()
+    {
+        lock_t lock(m_mutex);
+        if (!m_parent.valid() || m_top != std::end(m_memory)) return;
+
+        // Keep at least one byte, as Chunks cannot be empty.
+        const size_t used = std::max<size_t>(offset(m_last), 1);
+        if (used == m_memory.size()) return;
+
+        // Like in grow_memory, the lock of the parent is taken after the one
+        // of the sub-pool, ...
+        buffer_pool& parent = *m_parent.m_pool;
+        {
+            lock_t parentLock(parent.m_mutex);
+            parent.shrink_block(m_parent, used);
+        }
+        m_memory = m_parent.m_chunk;
+        m_top = std::end(m_memory);
+        publish_stats();
+        lock.unlock();
+
+        // ... but the requests waiting in the parent are served without the
+        // lock of the sub-pool, so their handlers may use it.
+        lock_t parentLock(parent.m_mutex);
+        parent.serve_waiters(parentLock);
+    }
+
+    /**
+     * @brief num_chunks Used for testing and statistical purposes.
+     * @return The number of mgm_chunks managed by the buffer_pool.
+     */
+    size_t num_chunks() const
+    {
+        lock_t lock(m_mutex);
+        return m_chunks.size();
+    }
+
+    /**
+     * @brief used_chunks The number of assigned mgm_chunks. Runs in O(1).
+     * @return The number of used mgm_chunks.
+     * Must be equal to the number of active Chunks.
+     */
+    size_t used_chunks() const
+    {
+        lock_t lock(m_mutex);
+        return m_usedChunks;
+    }
+
+    /**
+     * @brief unused_chunks The number of unused mgm_chunks. Runs in O(1).
+     * Can be used for tests and for measuring fragmentation.
+     * @return The number of unused mgm_chunks.
+     */
+    size_t unused_chunks() const
+    {
+        lock_t lock(m_mutex);
+        return m_chunks.size() - m_usedChunks;
+    }
+
+    /**
+     * @brief set_tag_name Assigns a name to a tag which is shown in reports.
+     * @param tag The tag to be named.
+     * @param name The name of the tag. Must outlive the buffer_pool.
+     * @throw std::out_of_range The tag is not below the max_tags of the
+     * POLICY.
+     */
+    void set_tag_name(tag_t tag, const char* name)
+    {
+        check_tag(tag);
+        lock_t lock(m_mutex);
+        tag_entry(tag).m_name = name;
+    }
+
+    /**
+     * @brief tag_name The name assigned to a tag by set_tag_name.
+     * @return The name or nullptr if the tag has no name.
+     */
+    const char* tag_name(tag_t tag) const
+    {
+        lock_t lock(m_mutex);
+        return name_of(tag);
+    }
+
+    /**
+     * @brief set_quota Limits the memory used by the Chunks of a tag.
+     * @param tag The tag to be limited.
+     * @param soft If exceeded by a request, the request is granted but
+     * counted and reported to the soft quota handler.
+     * @param hard Requests which would exceed it are rejected by throwing
+     * quota_exceeded.
+     * @throw std::out_of_range The tag is not below the max_tags of the
+     * POLICY.
+     */
+    void set_quota(tag_t tag, size_t soft, size_t hard)
+    {
+        assert(soft <= hard);
+        check_tag(tag);
+        lock_t lock(m_mutex);
+        tag_usage& usage = tag_entry(tag).m_usage;
+        usage.soft_quota = soft;
+        usage.hard_quota = hard;
+        serve_waiters(lock);
+    }
+
+    /**
+     * @brief set_soft_quota_handler Sets a function which is called whenever
+     * a request exceeds the soft quota of its tag. It must not call into the
+     * buffer_pool.
+     */
+    void set_soft_quota_handler(soft_quota_handler_t handler)
+    {
+        lock_t lock(m_mutex);
+        m_softQuotaHandler = std::move(handler);
+    }
+
+    /**
+     * @brief usage The memory accounting of a tag.
+     * @return The accounting. All zero for tags which were never used or
+     * are not accounted.
+     */
+    tag_usage usage(tag_t tag) const
+    {
+        lock_t lock(m_mutex);
+        return accounted(tag) && tag < m_tags.size() ? m_tags[tag].m_usage
+                                                     : tag_usage();
+    }
+
+    /**
+     * @brief stats_snapshot A consistent view of the usage, fragmentation
+     * and operation counts as of the last completed operation. It takes no
+     * lock, so it can be called from any thread, e.g. by a metrics exporter,
+     * even if the POLICY is not threadsafe. It only retries while an
+     * operation publishes new stats. Requires a POLICY publishing the stats.
+     */
+    stats stats_snapshot() const
+    {
+        static_assert(POLICY::publish_stats,
+                      "stats_snapshot requires a POLICY publishing the stats");
+        uint64_t words[stats_words];
+        uint32_t sequence;
+        do
+        {
+            do
+                sequence = m_statsSequence.load(std::memory_order_acquire);
+            while (sequence % 2 != 0);
+            for (size_t i = 0; i < stats_words; ++i)
+                words[i] = m_statsWords[i].load(std::memory_order_acquire);
+        } while (m_statsSequence.load(std::memory_order_relaxed) != sequence);
+
+        stats result;
+        std::memcpy(&result, words, sizeof(result));
+        return result;
+    }
+
+    /**
+     * @brief costs The search lengths of the requests, the bytes moved by
+     * inserting and erasing mgm_chunks and the merges of the releases since
+     * construction or reset_costs. Requires a POLICY counting the costs.
+     */
+    cost_stats costs() const
+    {
+        static_assert(POLICY::count_costs,
+                      "costs requires a POLICY counting the costs");
+        lock_t lock(m_mutex);
+        return m_costs;
+    }
+
+    /**
+     * @brief reset_costs Restarts counting the costs, e.g. after a warm-up.
+     */
+    void reset_costs()
+    {
+        lock_t lock(m_mutex);
+        m_costs = cost_stats();
+    }
+
+    /**
+     * @brief for_each_block Calls f with a block_info for each mgm_chunk in
+     * the order of their offsets. Blocks behind the last one are free.
+     * f must not call into the buffer_pool.
+     */
+    template <class F>
+    void for_each_block(F f) const
+    {
+        lock_t lock(m_mutex);
+        visit_blocks(f);
+    }
+
+    /**
+     * @brief dump_heap_map Writes the layout of the memory as compact JSON,
+     * e.g. for the heap_map tool:
+     *
+     *     {"size":1024,"blocks":[[0,10,1,3],[10,20,0,0]]}
+     *
+     * Each block is described by its offset, size, 1 if in use or 0 if free
+     * and tag, as by for_each_block. Memory behind the last block is free.
+     * @param os The stream to write the heap map to.
+     */
+    void dump_heap_map(std::ostream& os) const
+    {
+        lock_t lock(m_mutex);
+        os << "{\"size\":" << m_memory.size() << ",\"blocks\":[";
+        const char* separator = "";
+        auto write = [&](const block_info& b) {
+            os << separator << '[' << b.offset << ',' << b.size << ','
+               << b.in_use << ',' << b.tag << ']';
+            separator = ",";
+        };
+        visit_blocks(write);
+        os << "]}\n";
+    }
+
+private:
+    template <class F>
+    void visit_blocks(F& f) const
+    {
+        const auto ready = ready_blocks();
+        for (auto it = begin(m_chunks); it != end(m_chunks); ++it)
+        {
+            // The unused memory in front of the long-lived mgm_chunks.
+            if (it->m_first == m_top && m_last != m_top)
+                f(block_info{offset(m_last),
+                             static_cast<uint64_t>(std::distance(m_last, m_top)),
+                             0, 0, 0});
+            const bool inUse = in_use(it, ready);
+            f(block_info{offset(it->m_first),
+                         static_cast<uint64_t>(
+                             std::distance(it->m_first, block_end(it))),
+                         it->m_tag, inUse ? 1u : 0u,
+                         inUse ? chunk_size(it) : 0});
+        }
+    }
+
+public:
+    /**
+     * @brief offset The offset of the memory of a Chunk in the buffer_pool.
+     * Together with the size of the Chunk it identifies the Chunk
+     * independent of the address of the memory.
+     */
+    size_t offset(const Chunk& chunk) const
+    {
+        return std::distance(std::begin(m_memory), chunk.m_chunk.data());
+    }
+
+    /**
+     * @brief adopt Creates a Chunk for memory which is in use but not owned by
+     * any Chunk, because its Chunk was detached or the bookkeeping was
+     * restored.
+     * @param offset The offset of the Chunk as returned by offset().
+     * @param size The size of the Chunk.
+     * @return The Chunk owning the memory.
+     */
+    Chunk adopt(size_t offset, size_t size)
+    {
+        lock_t lock(m_mutex);
+        const pointer_t data = std::begin(m_memory) + offset;
+        assert(find_block(data - guard) != end(m_chunks));
+        assert(find_block(data - guard)->m_inUse);
+        assert(block_end(find_block(data - guard)) >= data + size + guard);
+        return Chunk(data, size, *this);
+    }
+
+    /**
+     * @brief compact Converts a Chunk into a compact_chunk. The memory stays
+     * in use until the compact_chunk is expanded or released.
+     * @throw std::length_error The memory of the buffer_pool is too large for
+     * compact_chunks.
+     */
+    compact_chunk compact(Chunk&& chunk)
+    {
+        assert(chunk.m_pool == this);
+        if (m_memory.size() > std::numeric_limits<uint32_t>::max())
+            throw std::length_error("memory too large for compact_chunk");
+
+        const compact_chunk handle{static_cast<uint32_t>(offset(chunk)),
+                                   static_cast<uint32_t>(chunk.m_chunk.size())};
+        chunk.detach();
+        return handle;
+    }
 
     /**
-     * @brief size The size of the memory assigned to the buffer_bool.
-     * @return The size in bytes.
+     * @brief expand Converts a compact_chunk back into a Chunk owning the
+     * memory. The compact_chunk must not be used anymore.
      */
-    size_t size() const { return m_memory.size(); }
+    Chunk expand(compact_chunk handle) { return adopt(handle.offset, handle.size); }
 
     /**
-     * @brief num_chunks Used for testing and statistical purposes.
-     * @return The number of mgm_chunks managed by the buffer_pool.
+     * @brief data The memory of a compact_chunk.
+     */
+    span_t data(compact_chunk handle) const
+    {
+        return span_t(std::begin(m_memory) + handle.offset, handle.size);
+    }
+
+    /**
+     * @brief release Releases the memory of a compact_chunk. The compact_chunk
+     * must not be used anymore.
      */
-    size_t num_chunks() const { return m_chunks.size(); }
+    void release(compact_chunk handle) { expand(handle).release(); }
 
     /**
-     * @brief used_chunks Calculates the number of assigned mgm_chunks.
-     * @return The number of used mgm_chunks.
-     * Must be equal to the number of active Chunks.
+     * @brief try_merge Fuses two Chunks which are adjacent in the memory into
+     * one without copying, e.g. to view a message received by consecutive
+     * reads contiguously. The bytes of b are accounted to the tag of a.
+     * Requires a POLICY without canaries, as they would lie between the data.
+     * @param a The Chunk in front, which grows by the memory of b.
+     * @param b The Chunk directly behind a. It becomes invalid if merged.
+     * @return True if merged, false if the Chunks are not adjacent.
+     */
+    bool try_merge(Chunk& a, Chunk&& b)
+    {
+        static_assert(guard == 0, "try_merge requires a POLICY without canaries");
+        assert(a.m_pool == this && b.m_pool == this);
+        lock_t lock(m_mutex);
+        if (a.m_chunk.end() != b.m_chunk.data() || b.m_chunk.data() == m_top)
+            return false;
+
+        const auto it = find_chunk(b);
+        assert(it != end(m_chunks) && it != begin(m_chunks));
+        const size_t size = b.m_chunk.size();
+        const tag_t tag = prev(it)->m_tag;
+        if (it->m_tag != tag)
+        {
+            unaccount(it->m_tag, size, true);
+            m_used += size;
+            if (accounted(tag))
+            {
+                tag_usage& usage = m_tags[tag].m_usage;
+                usage.used += size;
+                usage.peak = std::max(usage.peak, usage.used);
+            }
+        }
+        else
+        {
+            if (accounted(tag)) --m_tags[tag].m_usage.chunks;
+            --m_usedChunks;
+        }
+        erase_block(it);
+
+        // b is counted and traced as released, a as resized.
+        ++m_releases;
+        if (POLICY::count_costs) ++m_costs.releases;
+        publish_stats();
+        trace(pool_event::release, b.m_chunk.data(), size, 0);
+
+        a.m_chunk = span_t(a.m_chunk.data(), a.m_chunk.size() + size);
+        trace(pool_event::resize, a.m_chunk.data(), a.m_chunk.size(), 0);
+        b.detach();
+        return true;
+    }
+
+    /**
+     * @brief set_hold_released Holds released memory back instead of making it
+     * available again. Its data stays untouched until release_held() is
+     * called, which allows a checkpoint of the bookkeeping to still refer to
+     * it. Memory given up by Chunk::shrink and Chunk::consume is held back
+     * as well, except for the bytes the new canary is written to, and
+     * Chunk::resize moves a Chunk instead of moving its data in place or
+     * overwriting its back canary. Switching it off releases all held
+     * memory.
      */
-    size_t used_chunks()
+    void set_hold_released(bool hold)
     {
-        return std::count_if(begin(m_chunks), end(m_chunks),
-                             [](const auto& c) { return c.m_inUse; });
+        lock_t lock(m_mutex);
+        m_holdReleased = hold;
+        if (!hold) free_held(lock);
     }
 
     /**
-     * @brief unused_chunks Calculates the number of unused mgm_chunks.
-     * Can be used for tests and for measuring fragmentation.
-     * @return The number of unused mgm_chunks.
+     * @brief release_held Makes all memory held back since the last call
+     * available again. Runs in O(n).
+     */
+    void release_held()
+    {
+        lock_t lock(m_mutex);
+        free_held(lock);
+    }
+
+    /**
+     * @brief set_ready_lists Enables the adaptive mode for pools with a
+     * stable distribution of sizes. The pool samples the sizes of requests
+     * and maintain() keeps free blocks of the most common sizes pre-split in
+     * ready lists, so requests of these sizes only take a block from a list.
+     * Released Chunks of these sizes refill the lists. Ready blocks are not
+     * searched by other requests and are returned to the free memory if a
+     * request cannot be satisfied otherwise. Requires a POLICY with
+     * ready_lists.
+     * @param sizes The number of sizes to keep ready lists for. 0 disables
+     * the adaptive mode and returns all ready blocks.
+     * @param depth The number of blocks to keep ready per size.
+     */
+    void set_ready_lists(size_t sizes, size_t depth)
+    {
+        static_assert(POLICY::ready_lists,
+                      "set_ready_lists requires a POLICY with ready_lists");
+        lock_t lock(m_mutex);
+        m_readySizes = sizes;
+        m_readyDepth = sizes != 0 ? depth : 0;
+        m_readyHits = 0;
+        m_readyMisses = 0;
+        if (m_readyDepth == 0)
+        {
+            flush_ready();
+            m_readyLists.clear();
+            m_histogram.clear();
+            update_pressure();
+            serve_waiters(lock);
+        }
+    }
+
+    /**
+     * @brief set_quick_lists Keeps released small Chunks unmerged in the
+     * ready list of their size, so they are reused immediately by requests of
+     * the same size, like fastbins of malloc. The lists are merged again when
+     * a request cannot be satisfied otherwise and on releases while the pool
+     * is under pressure (see set_used_watermarks and
+     * set_largest_free_watermarks). Requires a POLICY with ready_lists.
+     * @param maxSize The size of the largest Chunks kept.
+     * @param depth The number of Chunks kept per size. 0 disables the quick
+     * lists and merges all blocks kept.
+     * @param sizes The number of sizes to keep Chunks for, the first ones
+     * released. Chunks of other sizes are merged as usual.
+     */
+    void set_quick_lists(size_t maxSize, size_t depth, size_t sizes = 16)
+    {
+        static_assert(POLICY::ready_lists,
+                      "set_quick_lists requires a POLICY with ready_lists");
+        lock_t lock(m_mutex);
+        m_quickMax = maxSize;
+        m_quickDepth = depth;
+        m_quickSizes = sizes;
+        for (auto& list : m_readyLists) list.m_quick = false;
+        if (depth == 0 && flush_ready())
+        {
+            update_pressure();
+            serve_waiters(lock);
+        }
+    }
+
+    /**
+     * @brief maintain Refills the ready lists of the most common sizes,
+     * splitting free memory from the end like for long-lived Chunks. Call it
+     * when the pool is idle. Runs in O(n) per block split.
+     */
+    void maintain()
+    {
+        lock_t lock(m_mutex);
+        if (m_readyDepth == 0) return;
+
+        // The most common sizes, most common first.
+        for (auto& list : m_readyLists)
+        {
+            if (list.m_hits != 0) sample(list.m_size, list.m_hits);
+            list.m_hits = 0;
+        }
+        auto common = m_histogram;
+        std::sort(begin(common), end(common),
+                  [](const size_count& a, const size_count& b) {
+                      return a.m_count > b.m_count;
+                  });
+        common.resize(std::min(common.size(), m_readySizes));
+        const auto isCommon = [&](size_t blockSize) {
+            return std::any_of(
+                begin(common), end(common),
+                [=](const size_count& c) { return c.m_size == blockSize; });
+        };
+
+        // Return the blocks of sizes which are not common anymore, unless
+        // they are fed by releases.
+        bool flushed = false;
+        for (auto it = begin(m_readyLists); it != end(m_readyLists);)
+        {
+            if (it->m_quick || isCommon(it->m_size))
+            {
+                ++it;
+                continue;
+            }
+            flushed = flushed || !it->m_blocks.empty();
+            empty_ready(*it);
+            it = m_readyLists.erase(it);
+        }
+        if (flushed) coalesce();
+
+        for (const auto& c : common)
+        {
+            auto list = std::find_if(
+                begin(m_readyLists), end(m_readyLists),
+                [&](const ready_list& l) { return l.m_size == c.m_size; });
+            if (list == end(m_readyLists))
+                list = m_readyLists.insert(end(m_readyLists),
+                                           ready_list{c.m_size, {}, false, 0});
+
+            // Like long-lived Chunks, from the end of the memory, so the
+            // search for short-lived Chunks does not pass them.
+            while (list->m_blocks.size() < m_readyDepth)
+            {
+                const auto it = place(c.m_size, c.m_size - 2 * guard,
+                                      lifetime::long_lived);
+                if (it == end(m_chunks)) break;
+                list->m_blocks.push_back(ready_block{it->m_first, it->m_tag});
+            }
+        }
+        update_pressure();
+        if (flushed) serve_waiters(lock);
+    }
+
+    /**
+     * @brief ready_list_stats The statistics of the ready lists, including
+     * the quick lists, since set_ready_lists was called.
+     */
+    ready_stats ready_list_stats() const
+    {
+        lock_t lock(m_mutex);
+        ready_stats stats{m_readyHits, m_readyMisses, 0, 0};
+        for (const auto& list : m_readyLists)
+        {
+            stats.blocks += list.m_blocks.size();
+            stats.bytes += list.m_blocks.size() * list.m_size;
+        }
+        return stats;
+    }
+
+    /**
+     * @brief num_tags Can be used to iterate over all tags for exporting
+     * their usage.
+     * @return One more than the highest accounted tag used, named or limited
+     * so far.
+     */
+    size_t num_tags() const
+    {
+        lock_t lock(m_mutex);
+        return m_tags.size();
+    }
+
+    /**
+     * @brief dump_live_chunks Writes one line for each Chunk in use with its
+     * offset in the buffer_pool, its size and its tag, followed by a summary.
+     * @param os The stream to write the report to.
+     */
+    void dump_live_chunks(std::ostream& os) const
+    {
+        lock_t lock(m_mutex);
+        size_t count = 0;
+        size_t bytes = 0;
+        const auto ready = ready_blocks();
+        for (auto it = begin(m_chunks); it != end(m_chunks); ++it)
+        {
+            if (!in_use(it, ready)) continue;
+
+            const size_t size = chunk_size(it);
+            const char* name = name_of(it->m_tag);
+            os << "offset " << offset(it->m_first + guard) << " size " << size
+               << " tag " << it->m_tag;
+            if (name != nullptr) os << " (" << name << ")";
+            os << '\n';
+
+            ++count;
+            bytes += size;
+        }
+        os << count << " live chunks, " << bytes << " bytes\n";
+    }
+
+    /**
+     * @brief check_integrity Walks all mgm_chunks and validates the
+     * bookkeeping, the canaries of all Chunks in use and, if poisoning is
+     * enabled, the poison of all free memory. Each problem found is reported
+     * to POLICY::corruption.
+     * Runs in O(n) for the bookkeeping plus O(size()) if poisoning is enabled.
+     * @return The number of problems found.
      */
-    size_t unused_chunks()
+    size_t check_integrity() const
     {
-        return std::count_if(begin(m_chunks), end(m_chunks),
-                             [](const auto& c) { return !c.m_inUse; });
+        lock_t lock(m_mutex);
+        size_t errors = 0;
+        auto report = [&](const char* what, pointer_t first, size_t size) {
+            POLICY::corruption(what, first, size);
+            ++errors;
+        };
+
+        if (m_last < std::begin(m_memory) || m_last > m_top ||
+            m_top > std::end(m_memory))
+            report("tail out of bounds", m_last, 0);
+
+        // Held memory keeps its data and, if given up by shrink or consume,
+        // has no canaries, so there is nothing to check.
+        const auto ready = ready_blocks();
+        for (auto it = begin(m_chunks); it != end(m_chunks); ++it)
+        {
+            const auto n = next(it);
+            const pointer_t last = block_end(it);
+            const size_t size = std::distance(it->m_first, last);
+
+            if (it->m_first >= last)
+                report("mgm_chunks out of order", it->m_first, size);
+            else if (in_use(it, ready))
+                errors += count_damaged_guards(it->m_first, size);
+            else if (is_free(*it) && n != end(m_chunks) && is_free(*n))
+                report("adjacent free chunks not merged", it->m_first, size);
+            else if (is_free(*it) && (at_tail(it) || it->m_first == m_top))
+                report("free chunk at the tail", it->m_first, size);
+            else if (!it->m_held && !is_poisoned(it->m_first, last))
+                report("released memory was modified", it->m_first, size);
+        }
+
+        if (!is_poisoned(m_last, m_top))
+            report("unused memory was modified", m_last,
+                   std::distance(m_last, m_top));
+
+        return errors;
     }
 
 private:
+    void free_held(lock_t& lock)
+    {
+        for (auto it = begin(m_chunks); it != end(m_chunks); ++it)
+        {
+            if (!it->m_held) continue;
+            it->m_held = false;
+            poison(it->m_first, block_end(it));
+        }
+        coalesce();
+        update_pressure();
+        serve_waiters(lock);
+    }
+
+    // Merges all adjacent free mgm_chunks and returns free mgm_chunks next to
+    // the unused memory to it. Runs in O(n).
+    void coalesce()
+    {
+        auto out = begin(m_chunks);
+        for (auto it = begin(m_chunks); it != end(m_chunks); ++it)
+        {
+            if (out != begin(m_chunks) && is_free(*it) && is_free(*prev(out)) &&
+                it->m_first != m_top)
+                continue;
+            if (POLICY::count_costs && out != it)
+                m_costs.moved_bytes += sizeof(mgm_chunk);
+            *out++ = *it;
+        }
+        m_chunks.erase(out, end(m_chunks));
+
+        auto top = first_top();
+        if (top != end(m_chunks) && is_free(*top))
+        {
+            m_top = block_end(top);
+            top = erase_block(top);
+        }
+        if (top != begin(m_chunks) && is_free(*prev(top)))
+        {
+            m_last = prev(top)->m_first;
+            erase_block(prev(top));
+        }
+    }
+
+    // Inserts an mgm_chunk constructed from args before pos, counting the
+    // bytes moved. It is constructed in place, as copying a temporary one
+    // stalls the store forwarding of the CPU on every request at the tail.
+    template <class... Args>
+    typename chunkVec_t::iterator insert_block(
+        typename chunkVec_t::const_iterator pos, Args&&... args)
+    {
+        count_moved(pos);
+        return m_chunks.emplace(pos, std::forward<Args>(args)...);
+    }
+
+    // Keeps the memory from first on, which a Chunk gave up, until
+    // release_held, like the block of a released Chunk.
+    void hold_block(typename chunkVec_t::const_iterator pos, pointer_t first)
+    {
+        insert_block(pos, first, false)->m_held = true;
+    }
+
+    // Erases the mgm_chunk at pos, counting the bytes moved.
+    typename chunkVec_t::iterator erase_block(
+        typename chunkVec_t::const_iterator pos)
+    {
+        count_moved(next(pos));
+        return m_chunks.erase(pos);
+    }
+
+    // Erases the mgm_chunk at pos merged by release.
+    typename chunkVec_t::iterator merge_block(
+        typename chunkVec_t::const_iterator pos)
+    {
+        if (POLICY::count_costs) ++m_costs.merges;
+        return erase_block(pos);
+    }
+
+    // Counts the bytes of the mgm_chunks from first on as moved.
+    void count_moved(typename chunkVec_t::const_iterator first)
+    {
+        if (POLICY::count_costs)
+            m_costs.moved_bytes +=
+                std::distance(first, m_chunks.cend()) * sizeof(mgm_chunk);
+    }
+
+    // Counts the mgm_chunks inspected by the current request.
+    void record_search()
+    {
+        if (!POLICY::count_costs) return;
+        ++m_costs.requests;
+        m_costs.searched += m_searched;
+        m_costs.max_searched =
+            std::max<uint64_t>(m_costs.max_searched, m_searched);
+        size_t bucket = 0;
+        while (bucket + 1 < cost_stats::buckets &&
+               (size_t(1) << bucket) <= m_searched)
+            ++bucket;
+        ++m_costs.search_histogram[bucket];
+    }
+
+    // The first address behind the mgm_chunk.
+    pointer_t block_end(typename chunkVec_t::const_iterator it) const
+    {
+        const auto n = next(it);
+        if (!POLICY::place_by_lifetime)
+            return n != end(m_chunks) ? n->m_first : m_last;
+        if (it->m_first >= m_top)
+            return n != end(m_chunks) ? n->m_first : std::end(m_memory);
+        return n != end(m_chunks) && n->m_first < m_top ? n->m_first : m_last;
+    }
+
+    const char* name_of(tag_t tag) const
+    {
+        return tag < m_tags.size() ? m_tags[tag].m_name : nullptr;
+    }
+
+    // Is the tag accounted in m_tags?
+    static bool accounted(tag_t tag) { return tag < POLICY::max_tags; }
+
+    static void check_tag(tag_t tag)
+    {
+        if (!accounted(tag)) throw std::out_of_range("tag exceeds max_tags");
+    }
+
+    tag_info& tag_entry(tag_t tag)
+    {
+        assert(accounted(tag));
+        if (m_tags.size() <= tag) m_tags.resize(tag + 1);
+        return m_tags[tag];
+    }
+
+    // Removes bytes of a Chunk from the used memory and the accounting of its
+    // tag.
+    void unaccount(tag_t tag, size_t size, bool released)
+    {
+        m_used -= released ? size + 2 * guard : size;
+        if (released) --m_usedChunks;
+        if (!accounted(tag)) return;
+
+        tag_usage& usage = m_tags[tag].m_usage;
+        usage.used -= size;
+        if (released) --usage.chunks;
+    }
+
+    // Undoes unaccount for a released Chunk which is kept after all.
+    void reaccount(tag_t tag, size_t size)
+    {
+        m_used += size + 2 * guard;
+        ++m_usedChunks;
+        if (!accounted(tag)) return;
+
+        tag_usage& usage = m_tags[tag].m_usage;
+        usage.used += size;
+        ++usage.chunks;
+    }
+
+    void set_watermark(watermark& mark, size_t raise, size_t clear,
+                       pressure_handler_t handler)
+    {
+        mark.m_raise = raise;
+        mark.m_clear = clear;
+        mark.m_raised = false;
+        mark.m_handler = std::move(handler);
+        update_pressure();
+    }
+
+    // Evaluates the watermarks and publishes the stats after the used memory
+    // has changed. The handlers must not throw, so the callers need no
+    // cleanup if they do, which keeps request and release cheap.
+    void update_pressure() noexcept
+    {
+        if (POLICY::watermarks &&
+            (m_usedMark.enabled() || m_largestFreeMark.enabled()))
+            update_watermarks();
+        publish_stats();
+    }
+
+    void update_watermarks()
+    {
+        if (m_usedMark.enabled()) m_usedMark.update_rising(m_used);
+        if (m_largestFreeMark.enabled())
+            m_largestFreeMark.update_falling(find_largest_free());
+    }
+
+    // Writes the stats for stats_snapshot. Only called under the lock, so
+    // there is a single writer.
+    void publish_stats()
+    {
+        if (!POLICY::publish_stats) return;
+        const stats current{m_memory.size(),
+                            m_used,
+                            m_usedChunks,
+                            m_chunks.size() - m_usedChunks,
+                            m_requests,
+                            m_failures,
+                            m_releases};
+        uint64_t words[stats_words];
+        std::memcpy(words, &current, sizeof(current));
+
+        const uint32_t sequence =
+            m_statsSequence.load(std::memory_order_relaxed);
+        // The release stores of the words order the odd sequence before
+        // them.
+        m_statsSequence.store(sequence + 1, std::memory_order_relaxed);
+        for (size_t i = 0; i < stats_words; ++i)
+            m_statsWords[i].store(words[i], std::memory_order_release);
+        m_statsSequence.store(sequence + 2, std::memory_order_release);
+    }
+
+    // Reports a request of the user after allocate. Failed requests are
+    // reported without a Chunk.
+    void trace_request(const Chunk& chunk, size_t size) const
+    {
+        trace(pool_event::request,
+              chunk.valid() ? chunk.m_chunk.data() : nullptr, size,
+              m_searched);
+    }
+
+    // Reports an operation to the POLICY and the USDT probes.
+    void trace(pool_event event, pointer_t chunk, size_t size,
+               size_t searched) const
+    {
+        if (!tracing) return;
+        switch (event)
+        {
+        case pool_event::request:
+            BUFFER_POOL_PROBE(request, chunk, size, searched);
+            break;
+        case pool_event::shrink:
+            BUFFER_POOL_PROBE(shrink, chunk, size, searched);
+            break;
+        case pool_event::release:
+            BUFFER_POOL_PROBE(release, chunk, size, searched);
+            break;
+        case pool_event::resize:
+            BUFFER_POOL_PROBE(resize, chunk, size, searched);
+            break;
+        }
+        POLICY::trace(event, chunk, size, searched);
+    }
+
+    size_t offset(pointer_t p) const
+    {
+        return std::distance(std::begin(m_memory), p);
+    }
+
     size_t size(const mgm_chunk& c) const
     {
         const auto it =
@@ -300,65 +2712,321 @@ private:
                          [=](const auto e) { return e.m_first == c.m_first; });
 
         assert(it != end(m_chunks));
+        return std::distance(c.m_first, block_end(it));
+    }
 
-        const auto n = next(it);
-        return n != end(m_chunks) ? std::distance(c.m_first, n->m_first)
-                                  : std::distance(c.m_first, m_last);
+    // The mgm_chunks are ordered by address, so use a binary search.
+    typename chunkVec_t::iterator find_block(pointer_t first)
+    {
+        const auto it = std::lower_bound(
+            begin(m_chunks), end(m_chunks), first,
+            [](const mgm_chunk& c, pointer_t p) { return c.m_first < p; });
+        return it != end(m_chunks) && it->m_first == first ? it
+                                                           : end(m_chunks);
     }
 
     typename chunkVec_t::iterator find_chunk(const Chunk& chunk)
     {
-        return std::find_if(begin(m_chunks), end(m_chunks),
-                            [&](const mgm_chunk& c) {
-                                return c.m_first == chunk.m_chunk.data();
-                            });
+        return find_block(chunk.m_chunk.data() - guard);
+    }
+
+    // Writes the canaries at both ends of the block [first, last) of a Chunk.
+    void write_guards(pointer_t first, pointer_t last)
+    {
+        if (guard == 0) return;
+        mark_defined(first, first + guard);
+        mark_defined(last - guard, last);
+        std::memset(first, POLICY::guard_byte, guard);
+        std::memset(last - guard, POLICY::guard_byte, guard);
+        mark_noaccess(first, first + guard);
+        mark_noaccess(last - guard, last);
+    }
+
+    // Tests if all bytes of memory inaccessible to the user, i.e. canaries
+    // or free memory, are set to value.
+    static bool is_filled(pointer_t first, size_t size, uint8_t value)
+    {
+        mark_defined(first, first + size);
+        bool filled = true;
+        for (size_t i = 0; i < size && filled; ++i)
+            filled = static_cast<uint8_t>(first[i]) == value;
+        mark_noaccess(first, first + size);
+        return filled;
+    }
+
+    // Counts the damaged canaries of the block [first, first + blockSize)
+    // which holds a Chunk and reports them.
+    size_t count_damaged_guards(pointer_t first, size_t blockSize) const
+    {
+        if (guard == 0) return 0;
+        size_t damaged = 0;
+        const size_t size = blockSize - 2 * guard;
+        if (!is_filled(first, guard, POLICY::guard_byte))
+        {
+            POLICY::corruption("front canary damaged", first + guard, size);
+            ++damaged;
+        }
+        if (!is_filled(first + guard + size, guard, POLICY::guard_byte))
+        {
+            POLICY::corruption("back canary damaged", first + guard, size);
+            ++damaged;
+        }
+        return damaged;
+    }
+
+    void check_guards(typename chunkVec_t::const_iterator it) const
+    {
+        if (guard == 0) return;
+        count_damaged_guards(it->m_first,
+                             std::distance(it->m_first, block_end(it)));
+    }
+
+    // The end of the block holding a Chunk of size bytes at data.
+    static pointer_t block_last(pointer_t data, size_t size)
+    {
+        return data - guard + block_size(size);
+    }
+
+    // The size of the Chunk in a block. Under AddressSanitizer, the padding
+    // behind its data is poisoned.
+    size_t chunk_size(typename chunkVec_t::const_iterator it) const
+    {
+        const size_t room =
+            std::distance(it->m_first, block_end(it)) - 2 * guard;
+#ifdef BUFFER_POOL_ASAN
+        const pointer_t data = it->m_first + guard;
+        if (void* poisoned = __asan_region_is_poisoned(data, room))
+            return std::distance(data, static_cast<pointer_t>(poisoned));
+#endif
+        return room;
+    }
+
+    // Makes memory which is no longer used by a Chunk inaccessible.
+    void poison(pointer_t first, pointer_t last)
+    {
+        if (first >= last) return;
+        if (POLICY::poison)
+        {
+            mark_defined(first, last);
+            std::memset(first, POLICY::poison_byte, std::distance(first, last));
+        }
+        mark_noaccess(first, last);
+    }
+
+    // The following functions annotate the memory for AddressSanitizer and
+    // Valgrind memcheck. They compile to nothing if neither is used.
+
+    // Memory which must not be accessed by anyone.
+    static void mark_noaccess(pointer_t first, pointer_t last)
+    {
+        const size_t size = std::distance(first, last);
+        (void)size;
+        BUFFER_POOL_ASAN_POISON(first, size);
+        BUFFER_POOL_VALGRIND_NOACCESS(first, size);
+    }
+
+    // Memory which was handed out but not yet written.
+    static void mark_undefined(pointer_t first, pointer_t last)
+    {
+        const size_t size = std::distance(first, last);
+        (void)size;
+        BUFFER_POOL_ASAN_UNPOISON(first, size);
+        BUFFER_POOL_VALGRIND_UNDEFINED(first, size);
+    }
+
+    // Memory which may be accessed and holds valid data.
+    static void mark_defined(pointer_t first, pointer_t last)
+    {
+        const size_t size = std::distance(first, last);
+        (void)size;
+        BUFFER_POOL_ASAN_UNPOISON(first, size);
+        BUFFER_POOL_VALGRIND_DEFINED(first, size);
+    }
+
+    bool is_poisoned(pointer_t first, pointer_t last) const
+    {
+        return !POLICY::poison || first >= last ||
+               is_filled(first, std::distance(first, last),
+                         POLICY::poison_byte);
+    }
+
+    // Checks that memory about to be handed out has not been written to since
+    // it was released.
+    void check_poison(pointer_t first, pointer_t last) const
+    {
+        if (!is_poisoned(first, last))
+            POLICY::corruption("released memory was modified", first,
+                               std::distance(first, last));
     }
 
     void release(const Chunk& chunk)
     {
+        lock_t lock(m_mutex);
         auto it = find_chunk(chunk);
         assert(it != end(m_chunks));
 
+        check_guards(it);
+        unaccount(it->m_tag, chunk.m_chunk.size(), true);
+        ++m_releases;
+        if (POLICY::count_costs) ++m_costs.releases;
+        trace(pool_event::release, chunk.m_chunk.data(), chunk.m_chunk.size(),
+              0);
+
+        free_block(it, chunk.m_chunk);
+        update_pressure();
+
+        // Even held back, the Chunk no longer counts against its quota.
+        serve_waiters(lock);
+    }
+
+    // Returns the block of a released Chunk to the free memory, merging it
+    // with its free neighbours, unless it is held back.
+    void free_block(typename chunkVec_t::iterator it, const span_t& data)
+    {
+        const pointer_t last = block_end(it);
+
         // First, invalidate!
         it->m_inUse = false;
 
-        // Then, see if we can merge it with a previous mgm_chunk.
-        if (it != begin(m_chunks) && !prev(it)->m_inUse)
-            it = prev(m_chunks.erase(it));
+        if (m_holdReleased)
+        {
+            // Keep the data until release_held.
+            it->m_held = true;
+            mark_noaccess(data.data(), data.data() + data.size());
+            return;
+        }
+
+        poison(it->m_first, last);
+
+        const bool pressure =
+            POLICY::watermarks &&
+            (m_usedMark.m_raised || m_largestFreeMark.m_raised);
+        if (POLICY::ready_lists && !pressure &&
+            (m_quickDepth != 0 || !m_readyLists.empty()) && keep_ready(it))
+            return;
+
+        // Then, see if we can merge it with a previous mgm_chunk. The
+        // mgm_chunks next to the unused memory are never free, so the
+        // short-lived and long-lived mgm_chunks are never merged.
+        if (it != begin(m_chunks) && is_free(*prev(it)))
+            it = prev(merge_block(it));
 
         const auto nextIt = next(it);
-        if (nextIt == end(m_chunks))
+        if (at_tail(it))
         {
             // If it's the last mgm_chunk, we can simply delete it and set the
             // m_last pointer to its beginning.
             m_last = it->m_first;
-            m_chunks.erase(it);
+            merge_block(it);
         }
         else
         {
             // If the next mgm_chunk is not used, we can merge those two.
-            if (!nextIt->m_inUse) m_chunks.erase(nextIt);
+            if (nextIt != end(m_chunks) && is_free(*nextIt))
+                merge_block(nextIt);
+
+            // The first long-lived mgm_chunk is returned to the unused memory.
+            if (it->m_first == m_top)
+            {
+                m_top = block_end(it);
+                merge_block(it);
+            }
+        }
+
+        // Consolidate the quick lists under pressure.
+        if (POLICY::ready_lists && pressure && m_quickDepth != 0) flush_ready();
+    }
+
+    // Keeps a released block unmerged in the ready list of its size, unless
+    // the list is full. Small blocks of other sizes start a quick list, unless
+    // there are quick lists for enough sizes.
+    bool keep_ready(typename chunkVec_t::iterator it)
+    {
+        const size_t blockSize = std::distance(it->m_first, block_end(it));
+        auto list = std::find_if(
+            begin(m_readyLists), end(m_readyLists),
+            [=](const ready_list& l) { return l.m_size == blockSize; });
+        if (list == end(m_readyLists) || !list->m_quick)
+        {
+            // The lists of maintain are refilled by releases as well.
+            if (list != end(m_readyLists) &&
+                list->m_blocks.size() < m_readyDepth)
+                return keep(*list, it);
+
+            if (m_quickDepth == 0 || blockSize > block_size(m_quickMax))
+                return false;
+            const size_t quick = std::count_if(
+                begin(m_readyLists), end(m_readyLists),
+                [](const ready_list& l) { return l.m_quick; });
+            if (quick >= m_quickSizes) return false;
+            if (list == end(m_readyLists))
+                list = m_readyLists.insert(end(m_readyLists),
+                                           ready_list{blockSize, {}, true, 0});
+            list->m_quick = true;
         }
+        if (list->m_blocks.size() >= m_quickDepth) return false;
+        return keep(*list, it);
+    }
+
+    // Puts the block of a released Chunk into a ready list.
+    static bool keep(ready_list& list, typename chunkVec_t::iterator it)
+    {
+        it->m_inUse = true;
+        list.m_blocks.push_back(ready_block{it->m_first, it->m_tag});
+        return true;
+    }
+
+    // Shrinks a Chunk for Chunk::shrink.
+    void resize(Chunk& chunk, size_t newSize)
+    {
+        lock_t lock(m_mutex);
+        shrink_block(chunk, newSize);
+        serve_waiters(lock);
     }
 
-    void resize(const Chunk& chunk)
+    // Shrinks a Chunk, leaving the waiting requests to the caller. Must be
+    // called with the lock held.
+    void shrink_block(Chunk& chunk, size_t newSize)
     {
         const auto it = find_chunk(chunk);
         assert(it != end(m_chunks));
+        check_guards(it);
+
+        // The new end of the mgm_chunk, behind the back canary.
+        const pointer_t data = chunk.m_chunk.data();
+        const pointer_t oldLast = block_end(it);
+        const pointer_t last = std::min(block_last(data, newSize), oldLast);
+        unaccount(it->m_tag, chunk.m_chunk.size() - newSize, false);
+        chunk.m_chunk = span_t(data, newSize);
+        mark_noaccess(data + newSize, last);
+        write_guards(it->m_first, last);
 
         const auto nextIt = next(it);
-        if (nextIt != end(m_chunks))
+        if (m_holdReleased)
         {
-            // Either insert a new unused mgm_chunk or extend the adjacent one.
-            if (nextIt->m_inUse)
-                m_chunks.insert(nextIt, mgm_chunk(chunk.m_chunk.end(), false));
-            else
-                nextIt->m_first = chunk.m_chunk.end();
+            // Keep the memory given up like a released block.
+            mark_noaccess(last, oldLast);
+            if (last != oldLast) hold_block(nextIt, last);
         }
-        else
+        else if (at_tail(it))
         {
+            poison(last, oldLast);
             // If this was the last mgm_chunk, we need to relocate m_last.
-            m_last = chunk.m_chunk.end();
+            m_last = last;
         }
+        else
+        {
+            // Either extend the adjacent unused mgm_chunk or insert a new one,
+            // unless only padding was given up.
+            poison(last, oldLast);
+            if (nextIt != end(m_chunks) && is_free(*nextIt))
+                nextIt->m_first = last;
+            else if (last != oldLast)
+                insert_block(nextIt, last, false);
+        }
+
+        update_pressure();
+        trace(pool_event::shrink, chunk.m_chunk.data(), chunk.m_chunk.size(),
+              0);
     }
 };
@@ -0,0 +1,315 @@
+#pragma once
+
+#include <atomic>
+#include <cerrno>
+#include <coroutine>
+#include <system_error>
+
+#include <sys/epoll.h>
+#include <unistd.h>
+
+#include <buffer_pool.hpp>
+
+/**
+ * C++20 coroutine support for buffer_pool.
+ *
+ * async_request suspends a coroutine until a buffer_pool can satisfy a
+ * request. async_read additionally reads from a non-blocking file descriptor
+ * into the Chunk, suspending until the descriptor becomes readable, and
+ * returns the Chunk shrunk to the bytes read.
+ *
+ *     task receive(epoll_reactor& reactor, pool_t& pool, int fd)
+ *     {
+ *         auto chunk = co_await async_read(reactor, pool, fd, 1024);
+ *         if (!chunk.valid()) co_return;  // End of file.
+ *         dispatch(std::move(chunk));
+ *     }
+ *
+ * The awaitables are state machines without coroutine frames or allocations
+ * of their own. A coroutine waiting for memory is resumed by the shrink or
+ * release that makes enough memory available, a coroutine waiting for data
+ * by epoll_reactor::run_once. The task type is left to the application.
+ */
+
+/**
+ * A minimal reactor waiting for file descriptors to become readable.
+ */
+class epoll_reactor
+{
+public:
+    /**
+     * @brief The operation struct is an intrusive node for an operation
+     * waiting for a file descriptor. It must stay alive until m_ready is
+     * called or the file descriptor is unwatched.
+     */
+    struct operation
+    {
+        void (*m_ready)(operation&) = nullptr;
+    };
+
+    epoll_reactor() : m_fd(::epoll_create1(EPOLL_CLOEXEC))
+    {
+        if (m_fd < 0)
+            throw std::system_error(errno, std::generic_category(),
+                                    "epoll_create1");
+    }
+
+    epoll_reactor(const epoll_reactor&) = delete;
+    epoll_reactor& operator=(const epoll_reactor&) = delete;
+
+    ~epoll_reactor() { ::close(m_fd); }
+
+    /**
+     * @brief watch_readable Calls op.m_ready from run_once once fd becomes
+     * readable. Only one operation can wait for a file descriptor at a time.
+     */
+    void watch_readable(int fd, operation& op)
+    {
+        epoll_event ev{};
+        ev.events = EPOLLIN | EPOLLONESHOT;
+        ev.data.ptr = &op;
+
+        // Re-arm the file descriptor or register it the first time.
+        if (::epoll_ctl(m_fd, EPOLL_CTL_MOD, fd, &ev) == 0) return;
+        if (errno != ENOENT || ::epoll_ctl(m_fd, EPOLL_CTL_ADD, fd, &ev) != 0)
+            throw std::system_error(errno, std::generic_category(),
+                                    "epoll_ctl");
+    }
+
+    /**
+     * @brief unwatch Stops waiting for fd, so the operation waiting for it
+     * can be destroyed. Does nothing if fd is not watched or already closed.
+     */
+    void unwatch(int fd) noexcept
+    {
+        ::epoll_ctl(m_fd, EPOLL_CTL_DEL, fd, nullptr);
+    }
+
+    /**
+     * @brief run_once Waits for file descriptors and runs the operations
+     * waiting for them.
+     * @param timeoutMs The maximum time to wait, -1 waits forever.
+     * @return The number of operations run.
+     */
+    size_t run_once(int timeoutMs)
+    {
+        epoll_event events[16];
+        const int n = ::epoll_wait(m_fd, events, 16, timeoutMs);
+        if (n < 0)
+        {
+            if (errno == EINTR) return 0;
+            throw std::system_error(errno, std::generic_category(),
+                                    "epoll_wait");
+        }
+
+        for (int i = 0; i < n; ++i)
+        {
+            auto& op = *static_cast<operation*>(events[i].data.ptr);
+            op.m_ready(op);
+        }
+        return n;
+    }
+
+private:
+    int m_fd;
+};
+
+namespace buffer_pool_detail
+{
+/**
+ * Decides whether the awaiting coroutine has to be suspended. Both the
+ * suspending coroutine and the completing operation call arrive(), the
+ * second one continues: either the coroutine does not suspend at all or the
+ * operation resumes it. This is safe if the operation completes on another
+ * thread.
+ */
+class rendezvous
+{
+public:
+    bool arrive() { return m_arrived.exchange(true, std::memory_order_acq_rel); }
+
+private:
+    std::atomic<bool> m_arrived{false};
+};
+}  // namespace buffer_pool_detail
+
+/**
+ * Awaitable returned by async_request.
+ */
+template <class POOL>
+class async_request_op
+{
+public:
+    using Chunk = typename POOL::Chunk;
+
+    async_request_op(POOL& pool, size_t size, typename POOL::tag_t tag)
+        : m_pool(pool), m_size(size), m_tag(tag)
+    {
+    }
+
+    // A coroutine destroyed while waiting for memory must not be resumed by
+    // the buffer_pool.
+    ~async_request_op()
+    {
+        if (m_waiter != 0) m_pool.cancel(m_waiter);
+    }
+
+    bool await_ready() const noexcept { return false; }
+
+    bool await_suspend(std::coroutine_handle<> handle)
+    {
+        m_handle = handle;
+        m_waiter = m_pool.request_async(
+            m_size,
+            [this](Chunk chunk) {
+                m_chunk = std::move(chunk);
+                if (m_rendezvous.arrive()) m_handle.resume();
+            },
+            m_tag);
+        return !m_rendezvous.arrive();
+    }
+
+    Chunk await_resume() { return std::move(m_chunk); }
+
+private:
+    POOL& m_pool;
+    size_t m_size;
+    typename POOL::tag_t m_tag;
+    Chunk m_chunk;
+    typename POOL::waiter_id m_waiter = 0;
+    std::coroutine_handle<> m_handle;
+    buffer_pool_detail::rendezvous m_rendezvous;
+};
+
+/**
+ * @brief async_request Requests a Chunk, suspending the coroutine until the
+ * buffer_pool has enough memory.
+ * @throw quota_exceeded The Chunk exceeds the hard quota of the tag.
+ */
+template <class POOL>
+async_request_op<POOL> async_request(POOL& pool, size_t size,
+                                     typename POOL::tag_t tag = 0)
+{
+    return async_request_op<POOL>(pool, size, tag);
+}
+
+/**
+ * Awaitable returned by async_read.
+ */
+template <class POOL>
+class async_read_op : epoll_reactor::operation
+{
+public:
+    using Chunk = typename POOL::Chunk;
+
+    async_read_op(epoll_reactor& reactor, POOL& pool, int fd, size_t size,
+                  typename POOL::tag_t tag)
+        : m_reactor(reactor), m_pool(pool), m_fd(fd), m_size(size), m_tag(tag)
+    {
+        m_ready = [](epoll_reactor::operation& op) {
+            auto& self = static_cast<async_read_op&>(op);
+            self.m_armed = false;
+            self.read();
+        };
+    }
+
+    async_read_op(const async_read_op&) = delete;
+    async_read_op& operator=(const async_read_op&) = delete;
+
+    // A coroutine destroyed while waiting for memory or data must not be
+    // resumed by the buffer_pool or the reactor.
+    ~async_read_op()
+    {
+        if (m_waiter != 0) m_pool.cancel(m_waiter);
+        if (m_armed) m_reactor.unwatch(m_fd);
+    }
+
+    bool await_ready() const noexcept { return false; }
+
+    bool await_suspend(std::coroutine_handle<> handle)
+    {
+        m_handle = handle;
+        m_waiter = m_pool.request_async(
+            m_size,
+            [this](Chunk chunk) {
+                m_chunk = std::move(chunk);
+                read();
+            },
+            m_tag);
+        return !m_rendezvous.arrive();
+    }
+
+    Chunk await_resume()
+    {
+        if (m_error != 0)
+            throw std::system_error(m_error, std::generic_category(), "read");
+        return std::move(m_chunk);
+    }
+
+private:
+    // Called by the handler of the buffer_pool, so it must not throw.
+    // Failing to watch m_fd is reported like a failed read.
+    void read()
+    {
+        const auto n = ::read(m_fd, m_chunk.m_chunk.data(), m_size);
+        if (n > 0)
+        {
+            m_chunk.shrink(n);
+        }
+        else if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK) && watch())
+        {
+            return;
+        }
+        else
+        {
+            // End of file or error.
+            if (n < 0 && m_error == 0) m_error = errno;
+            m_chunk.release();
+        }
+
+        if (m_rendezvous.arrive()) m_handle.resume();
+    }
+
+    bool watch() noexcept
+    {
+        try
+        {
+            m_reactor.watch_readable(m_fd, *this);
+        }
+        catch (const std::system_error& e)
+        {
+            m_error = e.code().value();
+            return false;
+        }
+        m_armed = true;
+        return true;
+    }
+
+    epoll_reactor& m_reactor;
+    POOL& m_pool;
+    int m_fd;
+    size_t m_size;
+    typename POOL::tag_t m_tag;
+    Chunk m_chunk;
+    typename POOL::waiter_id m_waiter = 0;
+    int m_error = 0;
+    bool m_armed = false;  // Is the reactor watching m_fd for this?
+    std::coroutine_handle<> m_handle;
+    buffer_pool_detail::rendezvous m_rendezvous;
+};
+
+/**
+ * @brief async_read Requests a Chunk of size bytes and reads into it from a
+ * non-blocking file descriptor, suspending the coroutine while either the
+ * buffer_pool has not enough memory or the file descriptor is not readable.
+ * The Chunk is held while waiting for data.
+ * @return The Chunk shrunk to the bytes read or an invalid Chunk at the end
+ * of file.
+ * @throw std::system_error Reading failed.
+ */
+template <class POOL>
+async_read_op<POOL> async_read(epoll_reactor& reactor, POOL& pool, int fd,
+                               size_t size, typename POOL::tag_t tag = 0)
+{
+    return async_read_op<POOL>(reactor, pool, fd, size, tag);
+}
@@ -0,0 +1,343 @@
+#pragma once
+
+#include <cerrno>
+#include <cstdint>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <system_error>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <buffer_pool.hpp>
+
+/**
+ * A buffer_pool whose memory is a memory-mapped file, so that Chunks survive
+ * a restart of the process.
+ *
+ * The file contains a header, two slots for checkpoints of the bookkeeping
+ * and the data of the buffer_pool:
+ *
+ *     | header | slot 0 | slot 1 | data |
+ *
+ * The bookkeeping is stored as offsets (see buffer_pool::block_info), so the
+ * file can be mapped at any address. While the process runs, the bookkeeping
+ * lives in the buffer_pool as usual. sync() writes a checkpoint:
+ *
+ * 1. The bookkeeping is written to the inactive slot.
+ * 2. The data and the slot are written to disk with msync.
+ * 3. The header is switched to the new slot and written to disk with msync.
+ *
+ * Memory released, shrunk or consumed after a checkpoint is held back until
+ * the next one and resize moves Chunks to new blocks rather than changing
+ * their old blocks, so the data of every Chunk referenced by the last
+ * checkpoint stays intact. Only with canaries, shrinking or consuming a
+ * Chunk writes its new canary over up to guard_size of the bytes it gives
+ * up. After a crash or restart, the last complete checkpoint is restored
+ * without reading or copying the data, and recover() returns the Chunks
+ * which were in use.
+ * The header only refers to a slot after it reached the disk, so a crash
+ * never leaves it referring to an incomplete checkpoint. The checkpoint
+ * before it is not a fallback for a damaged one: the memory released in
+ * between has been reused since.
+ * Chunks in use when the mapped_buffer_pool is destroyed must be detached to
+ * keep them for the next start.
+ *
+ * sync() must not run concurrently with other operations on the buffer_pool.
+ */
+template <class SPAN, class POLICY = default_pool_policy>
+class mapped_buffer_pool
+{
+public:
+    using pool_t = buffer_pool<SPAN, POLICY>;
+    using span_t = SPAN;
+    using Chunk = typename pool_t::Chunk;
+    using block_info = typename pool_t::block_info;
+
+    /**
+     * @brief mapped_buffer_pool Opens or creates the file and restores the
+     * last checkpoint.
+     * @param path The path of the file.
+     * @param size The size of the data in the buffer_pool.
+     * @param maxBlocks The maximum number of mgm_chunks a checkpoint can hold.
+     * @throw std::system_error The file could not be opened or mapped.
+     * @throw std::runtime_error The file does not match size and maxBlocks
+     * or its last checkpoint is damaged.
+     */
+    mapped_buffer_pool(const std::string& path, size_t size, size_t maxBlocks)
+        : m_map(path, layout_size(size, maxBlocks))
+    {
+        if (m_map.m_created)
+            init(size, maxBlocks);
+        else
+            validate(size, maxBlocks);
+
+        const slot& s = *active_slot();
+        const block_info* blocks = records(s);
+        m_pool.reset(new pool_t(data_span(), blocks, blocks + s.m_count));
+        m_pool->set_hold_released(true);
+    }
+
+    mapped_buffer_pool(const mapped_buffer_pool&) = delete;
+    mapped_buffer_pool& operator=(const mapped_buffer_pool&) = delete;
+
+    /**
+     * @brief pool The buffer_pool managing the data.
+     */
+    pool_t& pool() { return *m_pool; }
+
+    /**
+     * @brief recover Creates Chunks for all memory in use, i.e. the Chunks
+     * which were in use or detached at the last checkpoint. Call it once
+     * after construction.
+     */
+    std::vector<Chunk> recover()
+    {
+        std::vector<block_info> live;
+        m_pool->for_each_block([&](const block_info& b) {
+            if (b.in_use) live.push_back(b);
+        });
+
+        const size_t guard = POLICY::guard_size;
+        std::vector<Chunk> chunks;
+        chunks.reserve(live.size());
+        for (const auto& b : live)
+            chunks.push_back(m_pool->adopt(b.offset + guard, b.used));
+        return chunks;
+    }
+
+    /**
+     * @brief sync Writes a checkpoint of the data and the bookkeeping to
+     * disk. Afterwards, memory released since the last checkpoint becomes
+     * available again.
+     * @throw std::length_error The bookkeeping exceeds maxBlocks.
+     * @throw std::system_error Writing to disk failed.
+     */
+    void sync()
+    {
+        header& h = *m_map.get<header>(0);
+        const uint32_t next = 1 - h.m_active;
+        slot& s = *slot_at(next);
+        block_info* out = records(s);
+
+        uint64_t count = 0;
+        m_pool->for_each_block([&](const block_info& b) {
+            if (count == h.m_maxBlocks)
+                throw std::length_error("too many blocks for checkpoint");
+            out[count++] = b;
+        });
+        s.m_count = count;
+        s.m_generation = h.m_generation + 1;
+        s.m_checksum = checksum(s);
+
+        msync(data_offset(h.m_maxBlocks), h.m_size);
+        msync(slot_offset(next), slot_size(h.m_maxBlocks));
+
+        h.m_active = next;
+        h.m_generation = s.m_generation;
+        msync(0, page_size());
+
+        m_pool->release_held();
+    }
+
+private:
+    static constexpr uint64_t magic = 0x4c4f4f5042554642;  // "BFUBPOOL"
+    static constexpr uint32_t version = 2;
+
+    struct header
+    {
+        uint64_t m_magic;
+        uint32_t m_version;
+        uint32_t m_active;  // The slot holding the last checkpoint.
+        uint64_t m_size;
+        uint64_t m_maxBlocks;
+        uint64_t m_generation;
+    };
+
+    struct slot
+    {
+        uint64_t m_generation;
+        uint64_t m_count;
+        uint64_t m_checksum;
+        uint64_t m_reserved;
+        // Followed by m_maxBlocks block_infos.
+    };
+
+    /**
+     * @brief The mapping class owns the file and its mapping.
+     */
+    struct mapping
+    {
+        int m_fd = -1;
+        void* m_addr = MAP_FAILED;
+        size_t m_size = 0;
+        bool m_created = false;
+
+        mapping(const std::string& path, size_t size) : m_size(size)
+        {
+            m_fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+            if (m_fd < 0) fail("open");
+
+            struct stat st;
+            if (::fstat(m_fd, &st) != 0) fail("fstat");
+            if (st.st_size == 0)
+            {
+                if (::ftruncate(m_fd, size) != 0) fail("ftruncate");
+                m_created = true;
+            }
+            else if (static_cast<size_t>(st.st_size) != size)
+            {
+                ::close(m_fd);
+                throw std::runtime_error("file size does not match the pool");
+            }
+
+            m_addr = ::mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                            m_fd, 0);
+            if (m_addr == MAP_FAILED) fail("mmap");
+        }
+
+        mapping(const mapping&) = delete;
+        mapping& operator=(const mapping&) = delete;
+
+        ~mapping()
+        {
+            if (m_addr != MAP_FAILED) ::munmap(m_addr, m_size);
+            if (m_fd >= 0) ::close(m_fd);
+        }
+
+        template <class T>
+        T* get(size_t offset) const
+        {
+            return reinterpret_cast<T*>(static_cast<uint8_t*>(m_addr) + offset);
+        }
+
+        [[noreturn]] void fail(const char* what)
+        {
+            const int error = errno;
+            if (m_fd >= 0) ::close(m_fd);
+            throw std::system_error(error, std::generic_category(), what);
+        }
+    };
+
+    static size_t page_size() { return ::sysconf(_SC_PAGESIZE); }
+
+    static size_t round_up(size_t n)
+    {
+        return (n + page_size() - 1) / page_size() * page_size();
+    }
+
+    static size_t slot_size(size_t maxBlocks)
+    {
+        return round_up(sizeof(slot) + maxBlocks * sizeof(block_info));
+    }
+
+    static size_t slot_offset(uint32_t index, size_t maxBlocks)
+    {
+        return page_size() + index * slot_size(maxBlocks);
+    }
+
+    size_t slot_offset(uint32_t index) const
+    {
+        return slot_offset(index, m_map.get<header>(0)->m_maxBlocks);
+    }
+
+    static size_t data_offset(size_t maxBlocks)
+    {
+        return slot_offset(2, maxBlocks);
+    }
+
+    static size_t layout_size(size_t size, size_t maxBlocks)
+    {
+        return data_offset(maxBlocks) + size;
+    }
+
+    slot* slot_at(uint32_t index) const
+    {
+        return m_map.get<slot>(slot_offset(index));
+    }
+
+    static block_info* records(const slot& s)
+    {
+        return reinterpret_cast<block_info*>(
+            const_cast<slot*>(&s + 1));
+    }
+
+    span_t data_span() const
+    {
+        const header& h = *m_map.get<header>(0);
+        return span_t(m_map.get<typename span_t::element_type>(
+                          data_offset(h.m_maxBlocks)),
+                      h.m_size);
+    }
+
+    // FNV-1a over the generation, the count and the records of a slot.
+    static uint64_t checksum(const slot& s)
+    {
+        uint64_t hash = 0xcbf29ce484222325;
+        auto add = [&](const void* p, size_t n) {
+            const auto* bytes = static_cast<const uint8_t*>(p);
+            for (size_t i = 0; i < n; ++i)
+                hash = (hash ^ bytes[i]) * 0x100000001b3;
+        };
+        add(&s.m_generation, sizeof(s.m_generation));
+        add(&s.m_count, sizeof(s.m_count));
+        add(records(s), s.m_count * sizeof(block_info));
+        return hash;
+    }
+
+    bool valid(const slot& s) const
+    {
+        return s.m_count <= m_map.get<header>(0)->m_maxBlocks &&
+               s.m_checksum == checksum(s);
+    }
+
+    // The slot holding the last checkpoint.
+    const slot* active_slot() const
+    {
+        const slot* active = slot_at(m_map.get<header>(0)->m_active);
+        if (!valid(*active)) throw std::runtime_error("checkpoint is damaged");
+        return active;
+    }
+
+    void init(size_t size, size_t maxBlocks)
+    {
+        header& h = *m_map.get<header>(0);
+        h.m_version = version;
+        h.m_active = 0;
+        h.m_size = size;
+        h.m_maxBlocks = maxBlocks;
+        h.m_generation = 0;
+
+        slot& s = *slot_at(0);
+        s.m_generation = 0;
+        s.m_count = 0;
+        s.m_checksum = checksum(s);
+        msync(slot_offset(0), slot_size(maxBlocks));
+
+        // The magic number marks the file as complete.
+        h.m_magic = magic;
+        msync(0, page_size());
+    }
+
+    void validate(size_t size, size_t maxBlocks) const
+    {
+        const header& h = *m_map.get<header>(0);
+        if (h.m_magic != magic || h.m_version != version || h.m_active > 1)
+            throw std::runtime_error("not a buffer_pool file");
+        if (h.m_size != size || h.m_maxBlocks != maxBlocks)
+            throw std::runtime_error("file does not match the pool");
+    }
+
+    void msync(size_t offset, size_t size) const
+    {
+        if (::msync(m_map.get<uint8_t>(offset), size, MS_SYNC) != 0)
+            throw std::system_error(errno, std::generic_category(), "msync");
+    }
+
+    mapping m_map;
+    std::unique_ptr<pool_t> m_pool;
+};
@@ -0,0 +1,458 @@
+#pragma once
+
+#include <atomic>
+#include <cassert>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <system_error>
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/**
+ * A pool of memory in a POSIX shared-memory segment, shared by several
+ * processes to pass data without copying it.
+ *
+ * One process creates the segment, the others open it by name. A process
+ * requests memory, fills it and passes the returned token, which is only an
+ * offset and a size, e.g. over a pipe to another process. That process gets
+ * the data with data() and releases the token when it is done:
+ *
+ *     // Capture process
+ *     auto token = pool.request(packet.size());
+ *     std::memcpy(pool.data(token).data(), packet.data(), packet.size());
+ *     write(pipe, &token, sizeof(token));
+ *
+ *     // Worker process
+ *     read(pipe, &token, sizeof(token));
+ *     process(pool.data(token));
+ *     pool.release(token);
+ *
+ * The bookkeeping works like the one of buffer_pool, but is stored as offsets
+ * in the segment, so it can be mapped at a different address in each process.
+ * It holds at most maxBlocks mgm_chunks. All operations are protected by a
+ * process-shared mutex. If a process dies while holding it, the next process
+ * locking it checks the bookkeeping. If it is consistent, the pool stays
+ * usable and recoveries() counts the event; memory the dead process had
+ * requested stays in use. Otherwise the process dying in the middle of an
+ * update damaged it: the operation throws std::runtime_error and all later
+ * ones throw std::system_error.
+ */
+template <class SPAN>
+class shared_buffer_pool
+{
+public:
+    using span_t = SPAN;
+
+    /**
+     * @brief The token struct identifies memory of a shared_buffer_pool in
+     * all processes. It can be copied byte by byte.
+     */
+    struct token
+    {
+        uint64_t offset;  // Offset of the memory in the data of the pool.
+        uint64_t size;    // Size of the memory in bytes.
+    };
+
+    /**
+     * @brief shared_buffer_pool Creates a new shared-memory segment.
+     * @param name The name of the segment as passed to shm_open.
+     * @param size The size of the memory for data.
+     * @param maxBlocks The maximum number of mgm_chunks.
+     * @throw std::system_error The segment exists or could not be created.
+     */
+    shared_buffer_pool(const std::string& name, size_t size, size_t maxBlocks)
+        : m_map(name, layout_size(maxBlocks) + size, true)
+    {
+        header& h = get_header();
+        h.m_size = size;
+        h.m_maxBlocks = maxBlocks;
+        h.m_used = 0;
+        h.m_last = 0;
+        h.m_count = 0;
+        h.m_recoveries = 0;
+        h.m_mutex.init();
+
+        // The magic number tells other processes that the pool is ready.
+        std::atomic_thread_fence(std::memory_order_release);
+        h.m_magic = magic;
+    }
+
+    /**
+     * @brief shared_buffer_pool Opens an existing shared-memory segment.
+     * @param name The name of the segment as passed to shm_open.
+     * @throw std::system_error The segment could not be opened.
+     * @throw std::runtime_error The segment is no shared_buffer_pool.
+     */
+    explicit shared_buffer_pool(const std::string& name)
+        : m_map(name, 0, false)
+    {
+        const header& h = get_header();
+        if (m_map.m_size < sizeof(header) || h.m_magic != magic ||
+            m_map.m_size != layout_size(h.m_maxBlocks) + h.m_size)
+            throw std::runtime_error("not a shared_buffer_pool");
+        std::atomic_thread_fence(std::memory_order_acquire);
+    }
+
+    shared_buffer_pool(const shared_buffer_pool&) = delete;
+    shared_buffer_pool& operator=(const shared_buffer_pool&) = delete;
+
+    /**
+     * @brief remove Removes the name of a segment. Processes which have it
+     * open can still use it.
+     */
+    static void remove(const std::string& name) { ::shm_unlink(name.c_str()); }
+
+    /**
+     * @brief request Requests memory from the pool.
+     * @param size The size of the memory, must not be 0.
+     * @throw std::overflow_error Not enough continuous memory or too many
+     * mgm_chunks.
+     * @throw std::runtime_error A dead process damaged the bookkeeping.
+     * @return The token identifying the memory.
+     */
+    token request(size_t size)
+    {
+        assert(size > 0);
+        header& h = get_header();
+        scoped_lock lock(*this);
+        block* blocks = get_blocks();
+
+        // Search from the back like buffer_pool.
+        size_t i = h.m_count;
+        while (i > 0 && (blocks[i - 1].m_inUse || block_size(i - 1) < size))
+            --i;
+
+        if (i == 0)
+        {
+            if (h.m_size - h.m_last < size || h.m_count == h.m_maxBlocks)
+                throw std::overflow_error("out of memory");
+            i = h.m_count++;
+            blocks[i] = block{h.m_last, 1};
+            h.m_last += size;
+        }
+        else
+        {
+            block& b = blocks[--i];
+            if (block_size(i) != size)
+            {
+                if (h.m_count == h.m_maxBlocks)
+                    throw std::overflow_error("out of memory");
+                insert(i + 1, block{b.m_offset + size, 0});
+            }
+            b.m_inUse = 1;
+        }
+
+        h.m_used += size;
+        return token{blocks[i].m_offset, size};
+    }
+
+    /**
+     * @brief release Returns memory to the pool. Any process may release it,
+     * but only once.
+     * @throw std::invalid_argument The token is not in use.
+     * @throw std::runtime_error A dead process damaged the bookkeeping.
+     */
+    void release(const token& t)
+    {
+        header& h = get_header();
+        scoped_lock lock(*this);
+        block* blocks = get_blocks();
+
+        // find() returns the first block not before the offset, so the token
+        // must match it exactly.
+        size_t i = find(t.offset);
+        if (i >= h.m_count || blocks[i].m_offset != t.offset ||
+            !blocks[i].m_inUse || block_size(i) != t.size)
+            throw std::invalid_argument("token is not in use");
+        blocks[i].m_inUse = 0;
+        h.m_used -= t.size;
+
+        // Merge with free neighbours, or return the last block to the tail.
+        if (i + 1 < h.m_count && !blocks[i + 1].m_inUse) erase(i + 1);
+        if (i > 0 && !blocks[i - 1].m_inUse) erase(i--);
+        if (i + 1 == h.m_count)
+        {
+            h.m_last = blocks[i].m_offset;
+            --h.m_count;
+        }
+    }
+
+    /**
+     * @brief data The memory identified by a token in this process.
+     * @throw std::out_of_range The token exceeds the pool.
+     */
+    span_t data(const token& t) const
+    {
+        if (t.offset > size() || t.size > size() - t.offset)
+            throw std::out_of_range("token exceeds the pool");
+        return span_t(data_begin() + t.offset, t.size);
+    }
+
+    size_t used_mem() const
+    {
+        scoped_lock lock(*this);
+        return get_header().m_used;
+    }
+
+    size_t free_mem() const { return size() - used_mem(); }
+
+    size_t size() const { return get_header().m_size; }
+
+    size_t num_chunks() const
+    {
+        scoped_lock lock(*this);
+        return get_header().m_count;
+    }
+
+    /**
+     * @brief recoveries The number of times a process died while holding the
+     * mutex and the bookkeeping was found consistent afterwards.
+     */
+    size_t recoveries() const
+    {
+        scoped_lock lock(*this);
+        return get_header().m_recoveries;
+    }
+
+private:
+    static constexpr uint64_t magic = 0x4d48534c4f4f5042;  // "BPOOLSHM"
+
+    /**
+     * @brief The process_mutex struct is a robust, process-shared mutex.
+     */
+    struct process_mutex
+    {
+        pthread_mutex_t m_mutex;
+
+        void init()
+        {
+            pthread_mutexattr_t attr;
+            pthread_mutexattr_init(&attr);
+            pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+            pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+            const int error = pthread_mutex_init(&m_mutex, &attr);
+            pthread_mutexattr_destroy(&attr);
+            if (error != 0)
+                throw std::system_error(error, std::generic_category(),
+                                        "pthread_mutex_init");
+        }
+
+        // Returns false if the previous owner died while holding the mutex.
+        // Unless consistent() is called before unlocking it, the mutex
+        // becomes unusable.
+        bool lock()
+        {
+            const int error = pthread_mutex_lock(&m_mutex);
+            if (error == EOWNERDEAD) return false;
+            if (error != 0)
+                throw std::system_error(error, std::generic_category(),
+                                        "pthread_mutex_lock");
+            return true;
+        }
+
+        void consistent() { pthread_mutex_consistent(&m_mutex); }
+
+        void unlock() { pthread_mutex_unlock(&m_mutex); }
+    };
+
+    struct header
+    {
+        uint64_t m_magic;
+        uint64_t m_size;        // Size of the data.
+        uint64_t m_maxBlocks;   // Capacity of the block table.
+        uint64_t m_used;        // Bytes in use.
+        uint64_t m_last;        // The first unused offset in the data.
+        uint64_t m_count;       // Number of blocks in the table.
+        uint64_t m_recoveries;  // Owners of the mutex which died.
+        mutable process_mutex m_mutex;
+    };
+
+    // Like buffer_pool's mgm_chunk: a block ends where the next one begins.
+    struct block
+    {
+        uint64_t m_offset;
+        uint64_t m_inUse;
+    };
+
+    /**
+     * @brief The scoped_lock class holds the mutex of a pool. If its previous
+     * owner died, it checks the bookkeeping before it is used again.
+     */
+    class scoped_lock
+    {
+    public:
+        explicit scoped_lock(const shared_buffer_pool& pool)
+            : m_mutex(pool.get_header().m_mutex)
+        {
+            if (m_mutex.lock()) return;
+            if (!pool.consistent())
+            {
+                m_mutex.unlock();
+                throw std::runtime_error("bookkeeping damaged by a dead "
+                                         "process");
+            }
+            ++pool.get_header().m_recoveries;
+            m_mutex.consistent();
+        }
+
+        scoped_lock(const scoped_lock&) = delete;
+        scoped_lock& operator=(const scoped_lock&) = delete;
+
+        ~scoped_lock() { m_mutex.unlock(); }
+
+    private:
+        process_mutex& m_mutex;
+    };
+
+    /**
+     * @brief The mapping struct owns the mapping of the segment.
+     */
+    struct mapping
+    {
+        void* m_addr = MAP_FAILED;
+        size_t m_size = 0;
+
+        mapping(const std::string& name, size_t size, bool create)
+            : m_size(size)
+        {
+            const int fd =
+                create ? ::shm_open(name.c_str(), O_RDWR | O_CREAT | O_EXCL,
+                                    0600)
+                       : ::shm_open(name.c_str(), O_RDWR, 0);
+            if (fd < 0)
+                throw std::system_error(errno, std::generic_category(),
+                                        "shm_open");
+
+            struct stat st;
+            if ((create && ::ftruncate(fd, size) != 0) ||
+                (!create && ::fstat(fd, &st) != 0))
+            {
+                const int error = errno;
+                ::close(fd);
+                if (create) ::shm_unlink(name.c_str());
+                throw std::system_error(error, std::generic_category(),
+                                        "shm_open");
+            }
+            if (!create) m_size = st.st_size;
+
+            m_addr = ::mmap(nullptr, m_size, PROT_READ | PROT_WRITE,
+                            MAP_SHARED, fd, 0);
+            const int error = errno;
+            ::close(fd);
+            if (m_addr == MAP_FAILED)
+            {
+                if (create) ::shm_unlink(name.c_str());
+                throw std::system_error(error, std::generic_category(),
+                                        "mmap");
+            }
+        }
+
+        mapping(const mapping&) = delete;
+        mapping& operator=(const mapping&) = delete;
+
+        ~mapping() { ::munmap(m_addr, m_size); }
+    };
+
+    // The header and the block table, rounded to 64 bytes.
+    static size_t layout_size(size_t maxBlocks)
+    {
+        return (sizeof(header) + maxBlocks * sizeof(block) + 63) / 64 * 64;
+    }
+
+    header& get_header() const { return *static_cast<header*>(m_map.m_addr); }
+
+    block* get_blocks() const
+    {
+        return reinterpret_cast<block*>(&get_header() + 1);
+    }
+
+    typename span_t::element_type* data_begin() const
+    {
+        return reinterpret_cast<typename span_t::element_type*>(
+            static_cast<uint8_t*>(m_map.m_addr) +
+            layout_size(get_header().m_maxBlocks));
+    }
+
+    size_t block_size(size_t i) const
+    {
+        const header& h = get_header();
+        const block* blocks = get_blocks();
+        return (i + 1 < h.m_count ? blocks[i + 1].m_offset : h.m_last) -
+               blocks[i].m_offset;
+    }
+
+    // The blocks cover the data up to m_last without gaps, free blocks are
+    // merged with their neighbours and the last block is in use.
+    bool consistent() const
+    {
+        const header& h = get_header();
+        const block* blocks = get_blocks();
+        if (h.m_count > h.m_maxBlocks || h.m_last > h.m_size) return false;
+        if (h.m_count == 0) return h.m_last == 0 && h.m_used == 0;
+        if (blocks[0].m_offset != 0 || !blocks[h.m_count - 1].m_inUse)
+            return false;
+
+        uint64_t used = 0;
+        for (size_t i = 0; i < h.m_count; ++i)
+        {
+            const uint64_t end =
+                i + 1 < h.m_count ? blocks[i + 1].m_offset : h.m_last;
+            if (end <= blocks[i].m_offset || blocks[i].m_inUse > 1)
+                return false;
+            if (i > 0 && !blocks[i - 1].m_inUse && !blocks[i].m_inUse)
+                return false;
+            if (blocks[i].m_inUse) used += end - blocks[i].m_offset;
+        }
+        return used == h.m_used;
+    }
+
+    // The blocks are ordered by offset, so use a binary search.
+    size_t find(uint64_t offset) const
+    {
+        const header& h = get_header();
+        const block* blocks = get_blocks();
+        size_t first = 0, count = h.m_count;
+        while (count > 0)
+        {
+            const size_t step = count / 2;
+            if (blocks[first + step].m_offset < offset)
+            {
+                first += step + 1;
+                count -= step + 1;
+            }
+            else
+            {
+                count = step;
+            }
+        }
+        return first;
+    }
+
+    void insert(size_t i, const block& b)
+    {
+        header& h = get_header();
+        block* blocks = get_blocks();
+        std::memmove(blocks + i + 1, blocks + i,
+                     (h.m_count - i) * sizeof(block));
+        blocks[i] = b;
+        ++h.m_count;
+    }
+
+    void erase(size_t i)
+    {
+        header& h = get_header();
+        block* blocks = get_blocks();
+        std::memmove(blocks + i, blocks + i + 1,
+                     (h.m_count - i - 1) * sizeof(block));
+        --h.m_count;
+    }
+
+    mapping m_map;
+};
@@ -0,0 +1,206 @@
+#include <coroutine>
+#include <cstring>
+#include <exception>
+#include <string>
+
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <buffer_pool_coro.hpp>
+
+#include "tests.hpp"
+
+namespace
+{
+// An eagerly started coroutine which is not awaited.
+struct task
+{
+    struct promise_type
+    {
+        task get_return_object() { return {}; }
+        std::suspend_never initial_suspend() noexcept { return {}; }
+        std::suspend_never final_suspend() noexcept { return {}; }
+        void return_void() {}
+        void unhandled_exception() { std::terminate(); }
+    };
+};
+
+// An eagerly started coroutine which is destroyed with the task, even while
+// it is suspended.
+struct owned_task
+{
+    struct promise_type
+    {
+        owned_task get_return_object()
+        {
+            return {std::coroutine_handle<promise_type>::from_promise(*this)};
+        }
+        std::suspend_never initial_suspend() noexcept { return {}; }
+        std::suspend_always final_suspend() noexcept { return {}; }
+        void return_void() {}
+        void unhandled_exception() { std::terminate(); }
+    };
+
+    ~owned_task() { m_handle.destroy(); }
+
+    std::coroutine_handle<promise_type> m_handle;
+};
+
+class buffer_pool_coro_test : public featured_pool_test
+{
+public:
+    buffer_pool_coro_test()
+    {
+        ::socketpair(AF_UNIX, SOCK_STREAM, 0, m_fds);
+        ::fcntl(m_fds[0], F_SETFL, O_NONBLOCK);
+    }
+
+    ~buffer_pool_coro_test()
+    {
+        ::close(m_fds[0]);
+        ::close(m_fds[1]);
+    }
+
+protected:
+    void send(const std::string& data)
+    {
+        ASSERT_EQ(data.size(), ::write(m_fds[1], data.data(), data.size()));
+    }
+
+    static std::string str(const pool_t::Chunk& c)
+    {
+        return std::string(c.m_chunk.begin(), c.m_chunk.end());
+    }
+
+    epoll_reactor m_reactor;
+    int m_fds[2];
+};
+}  // namespace anonymous
+
+TEST_F(buffer_pool_coro_test, AsyncRequestWaitsForMemory)
+{
+    auto c1 = m_pool.request(1000);
+    pool_t::Chunk received;
+
+    auto coro = [&]() -> task { received = co_await async_request(m_pool, 100); };
+    coro();
+    EXPECT_FALSE(received.valid());
+
+    c1.release();
+    EXPECT_EQ(100, received.m_chunk.size());
+}
+
+TEST_F(buffer_pool_coro_test, DestroyedRequestIsCancelled)
+{
+    auto c1 = m_pool.request(1000);
+    bool resumed = false;
+    {
+        auto coro = [&]() -> owned_task {
+            co_await async_request(m_pool, 100);
+            resumed = true;
+        };
+        auto t = coro();
+        EXPECT_EQ(1, m_pool.num_waiters());
+    }
+    EXPECT_EQ(0, m_pool.num_waiters());
+
+    c1.release();
+    EXPECT_FALSE(resumed);
+    EXPECT_EQ(0, m_pool.used_mem());
+}
+
+TEST_F(buffer_pool_coro_test, AsyncReadWaitsForData)
+{
+    pool_t::Chunk received;
+    bool done = false;
+
+    auto coro = [&]() -> task {
+        received = co_await async_read(m_reactor, m_pool, m_fds[0], 100);
+        done = true;
+    };
+    coro();
+    EXPECT_FALSE(done);
+    EXPECT_EQ(100, m_pool.used_mem());
+
+    send("hello");
+    EXPECT_EQ(1, m_reactor.run_once(1000));
+    ASSERT_TRUE(done);
+    EXPECT_EQ("hello", str(received));
+    EXPECT_EQ(5, m_pool.used_mem());
+}
+
+TEST_F(buffer_pool_coro_test, DestroyedReadIsUnwatched)
+{
+    {
+        auto op = async_read(m_reactor, m_pool, m_fds[0], 100);
+        EXPECT_TRUE(op.await_suspend(std::noop_coroutine()));
+    }
+    EXPECT_EQ(0, m_pool.used_mem());
+
+    send("late");
+    EXPECT_EQ(0, m_reactor.run_once(0));
+}
+
+TEST_F(buffer_pool_coro_test, AsyncReadReadyData)
+{
+    pool_t::Chunk received;
+
+    send("ready");
+    auto coro = [&]() -> task {
+        received = co_await async_read(m_reactor, m_pool, m_fds[0], 100);
+    };
+    coro();
+    EXPECT_EQ("ready", str(received));
+}
+
+TEST_F(buffer_pool_coro_test, AsyncReadWaitsForMemory)
+{
+    auto c1 = m_pool.request(1000);
+    pool_t::Chunk received;
+
+    send("data");
+    auto coro = [&]() -> task {
+        received = co_await async_read(m_reactor, m_pool, m_fds[0], 100);
+    };
+    coro();
+    EXPECT_FALSE(received.valid());
+
+    c1.release();
+    EXPECT_EQ("data", str(received));
+}
+
+TEST_F(buffer_pool_coro_test, DestroyedReadIsCancelled)
+{
+    auto c1 = m_pool.request(1000);
+    bool resumed = false;
+    {
+        auto coro = [&]() -> owned_task {
+            co_await async_read(m_reactor, m_pool, m_fds[0], 100);
+            resumed = true;
+        };
+        auto t = coro();
+        EXPECT_EQ(1, m_pool.num_waiters());
+    }
+    EXPECT_EQ(0, m_pool.num_waiters());
+
+    send("data");
+    c1.release();
+    EXPECT_FALSE(resumed);
+    EXPECT_EQ(0, m_pool.used_mem());
+}
+
+TEST_F(buffer_pool_coro_test, AsyncReadEndOfFile)
+{
+    bool done = false;
+    ::shutdown(m_fds[1], SHUT_WR);
+
+    auto coro = [&]() -> task {
+        auto c = co_await async_read(m_reactor, m_pool, m_fds[0], 100);
+        EXPECT_FALSE(c.valid());
+        done = true;
+    };
+    coro();
+    EXPECT_TRUE(done);
+    EXPECT_EQ(0, m_pool.used_mem());
+}
@@ -0,0 +1,226 @@
+#include <cstring>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <buffer_pool_mmap.hpp>
+
+#include "tests.hpp"
+
+namespace
+{
+// Detached Chunks are kept for the next start, so they are no leaks.
+struct persistent_policy : hardened_pool_policy
+{
+    static constexpr bool check_leaks = false;
+};
+
+class mapped_buffer_pool_test : public ::testing::Test
+{
+public:
+    using span_t = gsl::span<uint8_t>;
+    using mapped_t = mapped_buffer_pool<span_t, persistent_policy>;
+    using Chunk = mapped_t::Chunk;
+
+    mapped_buffer_pool_test()
+        : m_path(::testing::TempDir() + "buffer_pool_" +
+                 std::to_string(::getpid()) + ".map")
+    {
+        ::unlink(m_path.c_str());
+        open();
+    }
+
+    ~mapped_buffer_pool_test()
+    {
+        m_pool.reset();
+        ::unlink(m_path.c_str());
+    }
+
+protected:
+    // Simulates a restart of the process.
+    void open()
+    {
+        m_pool.reset();
+        m_pool.reset(new mapped_t(m_path, 1024, 16));
+    }
+
+    static void fill(Chunk& c, const std::string& s)
+    {
+        std::memcpy(c.m_chunk.data(), s.data(), s.size());
+    }
+
+    static std::string str(const Chunk& c)
+    {
+        return std::string(c.m_chunk.begin(), c.m_chunk.end());
+    }
+
+    std::string m_path;
+    std::unique_ptr<mapped_t> m_pool;
+};
+}  // namespace anonymous
+
+TEST_F(mapped_buffer_pool_test, ChunksSurviveRestart)
+{
+    auto& pool = m_pool->pool();
+    auto a = pool.request(5);
+    auto b = pool.request(5);
+    auto c = pool.request(5);
+    fill(a, "hello");
+    fill(b, "lost!");
+    fill(c, "world");
+
+    b.release();
+    m_pool->sync();
+    a.detach();
+    c.detach();
+
+    open();
+    auto chunks = m_pool->recover();
+    ASSERT_EQ(2u, chunks.size());
+    EXPECT_EQ("hello", str(chunks[0]));
+    EXPECT_EQ("world", str(chunks[1]));
+    EXPECT_EQ(0u, m_pool->pool().check_integrity());
+
+    // The memory of b between a and c can be reused.
+    auto d = m_pool->pool().request(5);
+    EXPECT_LT(chunks[0].m_chunk.data(), d.m_chunk.data());
+    EXPECT_LT(d.m_chunk.data(), chunks[1].m_chunk.data());
+}
+
+TEST_F(mapped_buffer_pool_test, ChangesAfterLastSyncAreLost)
+{
+    auto& pool = m_pool->pool();
+    auto a = pool.request(5);
+    fill(a, "hello");
+    m_pool->sync();
+
+    // Neither the release nor the new Chunk are synced before the "crash".
+    a.release();
+    auto b = pool.request(5);
+    fill(b, "world");
+    b.detach();
+
+    open();
+    auto chunks = m_pool->recover();
+    ASSERT_EQ(1u, chunks.size());
+    EXPECT_EQ("hello", str(chunks[0]));
+}
+
+TEST_F(mapped_buffer_pool_test, ReleasedMemoryIsHeldUntilSync)
+{
+    auto& pool = m_pool->pool();
+    auto a = pool.request(600);
+    a.release();
+    EXPECT_THROW(pool.request(600), std::overflow_error);
+
+    m_pool->sync();
+    EXPECT_NO_THROW(pool.request(600));
+}
+
+TEST_F(mapped_buffer_pool_test, ShrunkMemoryIsHeldUntilSync)
+{
+    auto& pool = m_pool->pool();
+    auto a = pool.request(24);
+    fill(a, "AAAAAAAABBBBBBBBCCCCCCCC");
+    m_pool->sync();
+
+    // The new back canary overwrites the Bs, but the Cs are not reused.
+    a.shrink(8);
+    auto b = pool.request(8);
+    fill(b, "XXXXXXXX");
+    a.detach();
+    b.detach();
+
+    open();
+    auto chunks = m_pool->recover();
+    ASSERT_EQ(1u, chunks.size());
+    EXPECT_EQ("AAAAAAAA", str(chunks[0]).substr(0, 8));
+    EXPECT_EQ("CCCCCCCC", str(chunks[0]).substr(16));
+    EXPECT_EQ(0u, m_pool->pool().check_integrity());
+}
+
+TEST_F(mapped_buffer_pool_test, GrowingAfterSyncMovesChunk)
+{
+    auto& pool = m_pool->pool();
+    auto a = pool.request(8);
+    fill(a, "AAAAAAAA");
+    m_pool->sync();
+
+    // Growing in place would overwrite the back canary.
+    a.resize(16);
+    fill(a, "BBBBBBBBBBBBBBBB");
+    a.detach();
+
+    open();
+    auto chunks = m_pool->recover();
+    ASSERT_EQ(1u, chunks.size());
+    EXPECT_EQ("AAAAAAAA", str(chunks[0]));
+    EXPECT_EQ(0u, m_pool->pool().check_integrity());
+}
+
+TEST_F(mapped_buffer_pool_test, GrowingIntoFrontAfterSyncMovesChunk)
+{
+    auto& pool = m_pool->pool();
+    auto c = pool.request(8);
+    auto a = pool.request(8);
+    auto b = pool.request(8);
+    fill(a, "AAAAAAAA");
+    c.release();
+    m_pool->sync();
+
+    // Growing into the memory of c would move the data of a.
+    a.resize(16);
+    fill(a, "BBBBBBBBBBBBBBBB");
+    a.detach();
+    b.detach();
+
+    open();
+    auto chunks = m_pool->recover();
+    ASSERT_EQ(2u, chunks.size());
+    EXPECT_EQ("AAAAAAAA", str(chunks[0]));
+    EXPECT_EQ(0u, m_pool->pool().check_integrity());
+}
+
+TEST_F(mapped_buffer_pool_test, RejectDamagedCheckpoint)
+{
+    auto& pool = m_pool->pool();
+    auto a = pool.request(5);
+    m_pool->sync();
+    a.release();
+    auto b = pool.request(5);
+    m_pool->sync();
+    b.detach();
+    m_pool.reset();
+
+    // The first sync writes to slot 1, the second one to slot 0 behind the
+    // header page. Damage the second checkpoint. The first one still refers
+    // to a, whose memory may have been reused since, so it is no fallback.
+    const int fd = ::open(m_path.c_str(), O_RDWR);
+    ASSERT_LE(0, fd);
+    const uint64_t garbage = 42;
+    ASSERT_EQ(static_cast<ssize_t>(sizeof(garbage)),
+              ::pwrite(fd, &garbage, sizeof(garbage),
+                       ::sysconf(_SC_PAGESIZE) + sizeof(uint64_t)));
+    ::close(fd);
+
+    EXPECT_THROW(open(), std::runtime_error);
+}
+
+TEST_F(mapped_buffer_pool_test, RejectMismatchingFile)
+{
+    m_pool.reset();
+    EXPECT_THROW(mapped_t(m_path, 2048, 16), std::runtime_error);
+    EXPECT_THROW(mapped_t(m_path, 1024, 8), std::runtime_error);
+}
+
+TEST_F(mapped_buffer_pool_test, SyncFailsIfTooManyBlocks)
+{
+    auto& pool = m_pool->pool();
+    std::vector<Chunk> chunks;
+    for (int i = 0; i < 17; ++i) chunks.push_back(pool.request(1));
+    EXPECT_THROW(m_pool->sync(), std::length_error);
+}
@@ -0,0 +1,228 @@
+#include <cstring>
+#include <stdexcept>
+#include <string>
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <gtest/gtest.h>
+#include <gsl.hpp>
+
+#include <buffer_pool_shm.hpp>
+
+namespace
+{
+class shared_buffer_pool_test : public ::testing::Test
+{
+public:
+    using span_t = gsl::span<uint8_t>;
+    using pool_t = shared_buffer_pool<span_t>;
+    using token = pool_t::token;
+
+    shared_buffer_pool_test()
+        : m_name("/buffer_pool_test_" + std::to_string(::getpid())),
+          m_pool(unused(m_name), 1024, 16)
+    {
+        ::pipe(m_toChild);
+        ::pipe(m_toParent);
+    }
+
+    ~shared_buffer_pool_test()
+    {
+        pool_t::remove(m_name);
+        for (int fd : {m_toChild[0], m_toChild[1], m_toParent[0],
+                       m_toParent[1]})
+            ::close(fd);
+    }
+
+protected:
+    // Removes a segment left behind by a crashed test.
+    static const std::string& unused(const std::string& name)
+    {
+        pool_t::remove(name);
+        return name;
+    }
+
+    // Runs f in a child process and returns its exit code.
+    template <class F>
+    int in_child(F f)
+    {
+        const pid_t pid = ::fork();
+        if (pid == 0) ::_exit(f());
+        return pid;
+    }
+
+    static int wait_for(pid_t pid)
+    {
+        int status = 0;
+        ::waitpid(pid, &status, 0);
+        return WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+    }
+
+    static void send(int fd, const token& t)
+    {
+        ASSERT_EQ(static_cast<ssize_t>(sizeof(t)), ::write(fd, &t, sizeof(t)));
+    }
+
+    static token receive(int fd)
+    {
+        token t{0, 0};
+        if (::read(fd, &t, sizeof(t)) != sizeof(t)) ::_exit(100);
+        return t;
+    }
+
+    // Locks the mutex of the pool in a child process, lets f modify the
+    // header and exits without unlocking it. The header holds seven words
+    // before the mutex.
+    template <class F>
+    void die_holding_lock(F f)
+    {
+        const pid_t pid = in_child([&] {
+            const int fd = ::shm_open(m_name.c_str(), O_RDWR, 0);
+            void* addr = ::mmap(nullptr, 4096, PROT_READ | PROT_WRITE,
+                                MAP_SHARED, fd, 0);
+            if (addr == MAP_FAILED) return 1;
+            auto* words = static_cast<uint64_t*>(addr);
+            if (::pthread_mutex_lock(
+                    reinterpret_cast<pthread_mutex_t*>(words + 7)) != 0)
+                return 1;
+            f(words);
+            return 0;
+        });
+        ASSERT_EQ(0, wait_for(pid));
+    }
+
+    std::string m_name;
+    pool_t m_pool;
+    int m_toChild[2];
+    int m_toParent[2];
+};
+}  // namespace anonymous
+
+TEST_F(shared_buffer_pool_test, RequestAndRelease)
+{
+    auto a = m_pool.request(100);
+    auto b = m_pool.request(200);
+    EXPECT_EQ(300u, m_pool.used_mem());
+    EXPECT_EQ(724u, m_pool.free_mem());
+    EXPECT_EQ(0u, a.offset);
+    EXPECT_EQ(100u, b.offset);
+
+    m_pool.release(a);
+    EXPECT_EQ(2u, m_pool.num_chunks());
+    auto c = m_pool.request(50);
+    EXPECT_EQ(0u, c.offset);
+    EXPECT_EQ(3u, m_pool.num_chunks());
+
+    m_pool.release(b);
+    m_pool.release(c);
+    EXPECT_EQ(0u, m_pool.used_mem());
+    EXPECT_EQ(0u, m_pool.num_chunks());
+    EXPECT_THROW(m_pool.request(1025), std::overflow_error);
+}
+
+TEST_F(shared_buffer_pool_test, TooManyBlocks)
+{
+    for (int i = 0; i < 16; ++i) m_pool.request(1);
+    EXPECT_THROW(m_pool.request(1), std::overflow_error);
+}
+
+TEST_F(shared_buffer_pool_test, OpenByName)
+{
+    pool_t other(m_name);
+    const auto t = m_pool.request(5);
+    std::memcpy(m_pool.data(t).data(), "hello", 5);
+
+    EXPECT_EQ(1024u, other.size());
+    EXPECT_EQ(5u, other.used_mem());
+    EXPECT_EQ(0, std::memcmp(other.data(t).data(), "hello", 5));
+    other.release(t);
+    EXPECT_EQ(0u, m_pool.used_mem());
+
+    EXPECT_THROW(pool_t("/buffer_pool_test_missing"), std::system_error);
+}
+
+TEST_F(shared_buffer_pool_test, PassTokensBetweenProcesses)
+{
+    const pid_t pid = in_child([&] {
+        // Open the segment again, so it is mapped at another address.
+        pool_t pool(m_name);
+        const token t = receive(m_toChild[0]);
+        if (std::memcmp(pool.data(t).data(), "ping", 4) != 0) return 1;
+        pool.release(t);
+
+        const token reply = pool.request(4);
+        std::memcpy(pool.data(reply).data(), "pong", 4);
+        send(m_toParent[1], reply);
+        return 0;
+    });
+
+    const token t = m_pool.request(4);
+    std::memcpy(m_pool.data(t).data(), "ping", 4);
+    send(m_toChild[1], t);
+
+    const token reply = receive(m_toParent[0]);
+    EXPECT_EQ(0, std::memcmp(m_pool.data(reply).data(), "pong", 4));
+    EXPECT_EQ(0, wait_for(pid));
+    EXPECT_EQ(4u, m_pool.used_mem());
+    m_pool.release(reply);
+    EXPECT_EQ(0u, m_pool.used_mem());
+}
+
+TEST_F(shared_buffer_pool_test, ConcurrentProcesses)
+{
+    auto worker = [&] {
+        for (int i = 0; i < 1000; ++i)
+            m_pool.release(m_pool.request(1 + i % 32));
+        return 0;
+    };
+    const pid_t a = in_child(worker);
+    const pid_t b = in_child(worker);
+    worker();
+
+    EXPECT_EQ(0, wait_for(a));
+    EXPECT_EQ(0, wait_for(b));
+    EXPECT_EQ(0u, m_pool.used_mem());
+    EXPECT_EQ(0u, m_pool.num_chunks());
+}
+
+TEST_F(shared_buffer_pool_test, RejectInvalidTokens)
+{
+    const auto a = m_pool.request(100);
+    m_pool.request(200);
+
+    EXPECT_THROW(m_pool.release(token{1, 99}), std::invalid_argument);
+    EXPECT_THROW(m_pool.release(token{0, 50}), std::invalid_argument);
+    EXPECT_THROW(m_pool.release(token{300, 1}), std::invalid_argument);
+    m_pool.release(a);
+    EXPECT_THROW(m_pool.release(a), std::invalid_argument);
+    EXPECT_EQ(200u, m_pool.used_mem());
+
+    EXPECT_EQ(24u, m_pool.data(token{1000, 24}).size());
+    EXPECT_THROW(m_pool.data(token{1000, 25}), std::out_of_range);
+    EXPECT_THROW(m_pool.data(token{UINT64_MAX, 2}), std::out_of_range);
+}
+
+TEST_F(shared_buffer_pool_test, RecoverFromDeadOwner)
+{
+    const auto a = m_pool.request(100);
+    die_holding_lock([](uint64_t*) {});
+
+    EXPECT_EQ(100u, m_pool.used_mem());
+    EXPECT_EQ(1u, m_pool.recoveries());
+    m_pool.release(a);
+    EXPECT_EQ(0u, m_pool.num_chunks());
+}
+
+TEST_F(shared_buffer_pool_test, RejectDamageByDeadOwner)
+{
+    m_pool.request(100);
+    // The owner died between marking a block and counting its bytes.
+    die_holding_lock([](uint64_t* header) { header[3] += 5; });
+
+    EXPECT_THROW(m_pool.used_mem(), std::runtime_error);
+    EXPECT_THROW(m_pool.request(1), std::system_error);
+}
@@ -1,10 +1,159 @@
+#include <atomic>
 #include <iostream>
+#include <chrono>
 #include <memory>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <type_traits>
+#include <vector>
 
 #include "tests.hpp"
 
 namespace
 {
+// A hardened policy which records corruptions instead of aborting.
+struct recording_policy : hardened_pool_policy
+{
+    static std::vector<std::string> reports;
+
+    static void corruption(const char* what, const void*, size_t)
+    {
+        reports.emplace_back(what);
+    }
+};
+std::vector<std::string> recording_policy::reports;
+
+// A policy which records leaked Chunks instead of printing them.
+struct leak_recording_policy : default_pool_policy
+{
+    static constexpr bool check_leaks = true;
+    static std::vector<std::pair<size_t, uint32_t>> leaks;
+
+    static void leaked(const void*, size_t size, uint32_t tag, const char*)
+    {
+        leaks.emplace_back(size, tag);
+    }
+};
+std::vector<std::pair<size_t, uint32_t>> leak_recording_policy::leaks;
+
+// A policy preserving the tail with thresholds fitting the tests.
+struct small_wilderness_policy : wilderness_pool_policy
+{
+    static constexpr size_t small_request = 16;
+    static constexpr size_t large_request = 256;
+};
+
+// A policy publishing the stats for other threads.
+struct monitored_policy : default_pool_policy
+{
+    static constexpr bool publish_stats = true;
+};
+
+// A policy counting the costs of the operations.
+struct costed_policy : default_pool_policy
+{
+    static constexpr bool count_costs = true;
+};
+
+// A policy publishing the stats and counting the costs.
+struct counted_policy : default_pool_policy
+{
+    static constexpr bool publish_stats = true;
+    static constexpr bool count_costs = true;
+};
+
+// A policy recording all operations.
+struct tracing_policy : default_pool_policy
+{
+    struct event
+    {
+        pool_event type;
+        const void* chunk;
+        size_t size;
+        size_t searched;
+    };
+    static std::vector<event> events;
+
+    static constexpr bool tracing = true;
+    static constexpr bool wait_for_memory = true;
+
+    static void trace(pool_event type, const void* chunk, size_t size,
+                      size_t searched)
+    {
+        events.push_back(event{type, chunk, size, searched});
+    }
+};
+std::vector<tracing_policy::event> tracing_policy::events;
+
+// A policy accounting a few tags, without canaries, whose requests can wait
+// for their quota.
+struct tagged_policy : default_pool_policy
+{
+    static constexpr size_t max_tags = 16;
+    static constexpr bool wait_for_memory = true;
+};
+
+// A mutex failing the test when it is locked recursively, instead of
+// deadlocking.
+struct checked_mutex
+{
+    void lock()
+    {
+        EXPECT_FALSE(m_locked) << "locked recursively";
+        m_locked = true;
+    }
+    bool try_lock()
+    {
+        lock();
+        return true;
+    }
+    void unlock() { m_locked = false; }
+
+    bool m_locked = false;
+};
+
+// A policy checking that the pool never calls out under its lock.
+struct checked_lock_policy : default_pool_policy
+{
+    using mutex_t = checked_mutex;
+    static constexpr bool wait_for_memory = true;
+};
+
+// A threadsafe policy accounting a few tags.
+struct threadsafe_tagged_policy : threadsafe_pool_policy
+{
+    static constexpr size_t max_tags = 16;
+};
+
+class tagged_pool_test : public ::testing::Test
+{
+public:
+    tagged_pool_test() : m_pool(span_t(m_memory, sizeof(m_memory))) {}
+    using span_t = gsl::span<uint8_t>;
+
+protected:
+    alignas(8) uint8_t m_memory[1024] = {0};
+
+    using pool_t = buffer_pool<span_t, tagged_policy>;
+    pool_t m_pool;
+};
+
+class hardened_pool_test : public ::testing::Test
+{
+public:
+    hardened_pool_test() : m_pool(span_t(m_memory, sizeof(m_memory)))
+    {
+        recording_policy::reports.clear();
+    }
+    using span_t = gsl::span<uint8_t>;
+
+protected:
+    alignas(8) uint8_t m_memory[1024] = {0};
+
+    using pool_t = buffer_pool<span_t, recording_policy>;
+    pool_t m_pool;
+};
 }  // namespace anonymous
 
 TEST_F(buffer_pool_test, Init)
@@ -132,48 +281,52 @@ TEST_F(buffer_pool_test, ReleaseAndMergePreceedingFreeChunk)
 
 TEST_F(buffer_pool_test, ShrinkChunkAndReclaimCompleteFreeMem)
 {
-    auto c1 = m_pool.request(20);
-    auto c2 = m_pool.request(20);
+    auto c1 = m_pool.request(32);
+    auto c2 = m_pool.request(32);
 
-    c1.shrink(10);
+    c1.shrink(8);
 
     EXPECT_EQ(2, m_pool.used_chunks());
-    EXPECT_EQ(30, m_pool.used_mem());
+    EXPECT_EQ(40, m_pool.used_mem());
 
-    auto c3 = m_pool.request(10);
+    // The 24 bytes given up take a Chunk of 24 bytes with its overhead.
+    auto c3 = m_pool.request(24 - overhead);
 
     EXPECT_EQ(3, m_pool.used_chunks());
-    EXPECT_EQ(40, m_pool.used_mem());
+    EXPECT_EQ(0, m_pool.unused_chunks());
+    EXPECT_EQ(64 - overhead, m_pool.used_mem());
 
-    EXPECT_EQ(std::end(c1.m_chunk), std::begin(c3.m_chunk));
+    EXPECT_EQ(c1.m_chunk.data() + pool_t::footprint(8), c3.m_chunk.data());
 }
 
 TEST_F(buffer_pool_test, ShrinkChunkAndReclaimPartialFreeMem)
 {
-    auto c1 = m_pool.request(20);
-    auto c2 = m_pool.request(20);
+    auto c1 = m_pool.request(40);
+    auto c2 = m_pool.request(40);
 
-    c1.shrink(10);
+    c1.shrink(8);
 
     EXPECT_EQ(2, m_pool.used_chunks());
     EXPECT_EQ(1, m_pool.unused_chunks());
-    EXPECT_EQ(30, m_pool.used_mem());
+    EXPECT_EQ(48, m_pool.used_mem());
 
-    auto c3 = m_pool.request(5);
+    auto c3 = m_pool.request(8);
 
     EXPECT_EQ(3, m_pool.used_chunks());
     EXPECT_EQ(1, m_pool.unused_chunks());
-    EXPECT_EQ(35, m_pool.used_mem());
+    EXPECT_EQ(56, m_pool.used_mem());
 
-    EXPECT_EQ(std::end(c1.m_chunk), std::begin(c3.m_chunk));
+    EXPECT_EQ(c1.m_chunk.data() + pool_t::footprint(8), c3.m_chunk.data());
 
-    auto c4 = m_pool.request(5);
+    // The rest of the 32 bytes given up.
+    const size_t rest = 32 - pool_t::footprint(8);
+    auto c4 = m_pool.request(rest - overhead);
 
     EXPECT_EQ(4, m_pool.used_chunks());
     EXPECT_EQ(0, m_pool.unused_chunks());
-    EXPECT_EQ(40, m_pool.used_mem());
+    EXPECT_EQ(56 + rest - overhead, m_pool.used_mem());
 
-    EXPECT_EQ(std::end(c3.m_chunk), std::begin(c4.m_chunk));
+    EXPECT_EQ(c3.m_chunk.data() + pool_t::footprint(8), c4.m_chunk.data());
 }
 
 TEST_F(buffer_pool_test, ShrinkLastChunkAndRelocateEndOfChunks)
@@ -185,5 +338,1290 @@ TEST_F(buffer_pool_test, ShrinkLastChunkAndRelocateEndOfChunks)
 
     auto c3 = m_pool.request(10);
 
-    EXPECT_EQ(std::end(c2.m_chunk), std::begin(c3.m_chunk));
+    EXPECT_EQ(c2.m_chunk.data() + pool_t::footprint(5), c3.m_chunk.data());
+}
+
+TEST_F(buffer_pool_test, ResizeGrowsInPlace)
+{
+    auto c1 = m_pool.request(10);
+    auto c2 = m_pool.request(10);
+    auto c3 = m_pool.request(10);
+    const auto data = c1.m_chunk.data();
+    const auto data3 = c3.m_chunk.data();
+    c1.m_chunk[0] = 42;
+    c2.release();
+
+    // Into the free successor, then into the unused memory at the tail.
+    c1.resize(20);
+    EXPECT_EQ(data, c1.m_chunk.data());
+    EXPECT_EQ(20, c1.m_chunk.size());
+    c3.resize(100);
+    EXPECT_EQ(data3, c3.m_chunk.data());
+    EXPECT_EQ(100, c3.m_chunk.size());
+
+    c1.resize(5);
+    EXPECT_EQ(data, c1.m_chunk.data());
+    EXPECT_EQ(42, c1.m_chunk[0]);
+    EXPECT_EQ(105, m_pool.used_mem());
+}
+
+TEST_F(buffer_pool_test, ResizeGrowsIntoPredecessor)
+{
+    auto c1 = m_pool.request(10);
+    auto c2 = m_pool.request(10);
+    auto c3 = m_pool.request(10);
+    auto c4 = m_pool.request(10);
+    const auto data = c3.m_chunk.data();
+    for (uint8_t i = 0; i < 10; ++i) c3.m_chunk[i] = i;
+    c1.release();
+    c2.release();
+
+    // The data moves to the front, taking only the bytes needed.
+    c3.resize(25);
+    const size_t extra = pool_t::footprint(25) - pool_t::footprint(10);
+    EXPECT_EQ(data - extra, c3.m_chunk.data());
+    EXPECT_EQ(25, c3.m_chunk.size());
+    for (uint8_t i = 0; i < 10; ++i) EXPECT_EQ(i, c3.m_chunk[i]);
+    EXPECT_EQ(35, m_pool.used_mem());
+    EXPECT_EQ(3, m_pool.num_chunks());
+}
+
+TEST_F(buffer_pool_test, ResizeRelocatesAsLastResort)
+{
+    auto c1 = m_pool.request(10);
+    auto c2 = m_pool.request(10);
+    const auto data = c2.m_chunk.data();
+    c1.m_chunk[0] = 42;
+
+    c1.resize(50);
+    EXPECT_EQ(data + pool_t::footprint(10), c1.m_chunk.data());
+    EXPECT_EQ(42, c1.m_chunk[0]);
+    EXPECT_EQ(60, m_pool.used_mem());
+    EXPECT_EQ(2, m_pool.used_chunks());
+
+    // A failed resize leaves the Chunk unchanged.
+    EXPECT_THROW(c2.resize(1000), std::overflow_error);
+    EXPECT_EQ(data, c2.m_chunk.data());
+    EXPECT_EQ(10, c2.m_chunk.size());
+    EXPECT_EQ(60, m_pool.used_mem());
+}
+
+TEST_F(featured_pool_test, ResizeDoesNotOvertakeWaitingRequests)
+{
+    auto c1 = m_pool.request(100);
+    auto c2 = m_pool.request(100);
+    auto c3 = m_pool.request(100);
+    m_pool.request_async(900, [](pool_t::Chunk) {});
+
+    // Neither in place, nor by moving the data.
+    EXPECT_THROW(c3.resize(200), std::overflow_error);
+    EXPECT_THROW(c2.resize(200), std::overflow_error);
+
+    // Nor into free memory in front.
+    c1.release();
+    EXPECT_THROW(c2.resize(150), std::overflow_error);
+    EXPECT_EQ(100, c2.m_chunk.size());
+    EXPECT_EQ(100, c3.m_chunk.size());
+    EXPECT_EQ(1, m_pool.num_waiters());
+}
+
+TEST_F(featured_pool_test, ResizeRelocationCountsOneBlock)
+{
+    std::vector<bool> signals;
+    m_pool.set_used_watermarks(
+        300, 280, [&](bool pressure) { signals.push_back(pressure); });
+    auto c1 = m_pool.request(100);
+    auto c2 = m_pool.request(100);
+
+    // Both blocks of c1 are in use while its data is moved.
+    c1.resize(150);
+    EXPECT_EQ(250, m_pool.used_mem());
+    EXPECT_EQ(2, m_pool.used_chunks());
+    EXPECT_TRUE(signals.empty());
+}
+
+TEST_F(featured_pool_test, ConsumeFromFront)
+{
+    auto c1 = m_pool.request(8);
+    auto c2 = m_pool.request(32);
+    const auto data = c1.m_chunk.data();
+    const auto data2 = c2.m_chunk.data();
+    for (uint8_t i = 0; i < 32; ++i) c2.m_chunk[i] = i;
+
+    c2.consume(8);
+    EXPECT_EQ(data2 + 8, c2.m_chunk.data());
+    EXPECT_EQ(24, c2.m_chunk.size());
+    EXPECT_EQ(8, c2.m_chunk[0]);
+    EXPECT_EQ(32, m_pool.used_mem());
+    EXPECT_EQ(1, m_pool.unused_chunks());
+
+    // The consumed memory is merged with the free memory in front.
+    c1.release();
+    EXPECT_EQ(1, m_pool.unused_chunks());
+    auto c3 = m_pool.request(16);
+    EXPECT_EQ(data, c3.m_chunk.data());
+
+    // The front of the first long-lived Chunk returns to the unused memory.
+    auto l = m_pool.request(500, 0, pool_t::lifetime::long_lived);
+    const auto largest = m_pool.largest_free();
+    l.consume(96);
+    EXPECT_EQ(largest + 96, m_pool.largest_free());
+    EXPECT_EQ(3, m_pool.num_chunks());
+}
+
+TEST_F(tagged_pool_test, SplitChunk)
+{
+    auto c1 = m_pool.request(30, 3);
+    for (uint8_t i = 0; i < 30; ++i) c1.m_chunk[i] = i;
+
+    auto c2 = c1.split(10);
+    auto c3 = c2.split(5);
+    EXPECT_EQ(10, c1.m_chunk.size());
+    EXPECT_EQ(std::end(c1.m_chunk), c2.m_chunk.data());
+    EXPECT_EQ(5, c2.m_chunk.size());
+    EXPECT_EQ(15, c3.m_chunk.size());
+    EXPECT_EQ(10, c2.m_chunk[0]);
+    EXPECT_EQ(15, c3.m_chunk[0]);
+    EXPECT_EQ(3, m_pool.used_chunks());
+    EXPECT_EQ(30, m_pool.used_mem());
+    EXPECT_EQ(3, m_pool.usage(3).chunks);
+    EXPECT_EQ(30, m_pool.usage(3).used);
+
+    // The parts are released independently.
+    c2.release();
+    EXPECT_EQ(1, m_pool.unused_chunks());
+    EXPECT_EQ(29, c3.m_chunk[14]);
+    c1.release();
+    c3.release();
+    EXPECT_EQ(0, m_pool.num_chunks());
+    EXPECT_EQ(0, m_pool.usage(3).chunks);
+}
+
+TEST_F(tagged_pool_test, MergeAdjacentChunks)
+{
+    auto c1 = m_pool.request(30, 1);
+    auto c3 = m_pool.request(5, 1);
+    auto c2 = c1.split(10);
+    const auto data = c1.m_chunk.data();
+
+    EXPECT_FALSE(m_pool.try_merge(c1, std::move(c3)));
+    EXPECT_TRUE(c3.valid());
+
+    EXPECT_TRUE(m_pool.try_merge(c1, std::move(c2)));
+    EXPECT_FALSE(c2.valid());
+    EXPECT_EQ(data, c1.m_chunk.data());
+    EXPECT_EQ(30, c1.m_chunk.size());
+    EXPECT_EQ(2, m_pool.used_chunks());
+    EXPECT_EQ(35, m_pool.used_mem());
+    EXPECT_EQ(35, m_pool.usage(1).used);
+    EXPECT_EQ(2, m_pool.usage(1).chunks);
+
+    // Merging undoes a split.
+    auto c4 = c1.split(10);
+    EXPECT_TRUE(m_pool.try_merge(c1, std::move(c4)));
+    EXPECT_EQ(30, c1.m_chunk.size());
+
+    c1.release();
+    c3.release();
+    EXPECT_EQ(0, m_pool.num_chunks());
+}
+
+#ifndef BUFFER_POOL_ASAN
+// Consecutive requests are never adjacent under AddressSanitizer, which
+// pads their blocks with redzones.
+TEST_F(tagged_pool_test, MergeAccountsToTheTagOfTheFront)
+{
+    auto c1 = m_pool.request(10, 1);
+    auto c2 = m_pool.request(20, 2);
+
+    EXPECT_TRUE(m_pool.try_merge(c1, std::move(c2)));
+    EXPECT_EQ(1, m_pool.used_chunks());
+    EXPECT_EQ(30, m_pool.used_mem());
+    EXPECT_EQ(30, m_pool.usage(1).used);
+    EXPECT_EQ(1, m_pool.usage(1).chunks);
+    EXPECT_EQ(0, m_pool.usage(2).used);
+    EXPECT_EQ(0, m_pool.usage(2).chunks);
+}
+#endif
+
+TEST_F(buffer_pool_test, CountersFollowAllOperations)
+{
+    const pool_t& pool = m_pool;
+    auto check = [&] {
+        size_t used = 0;
+        pool.for_each_block(
+            [&](const pool_t::block_info& b) { used += b.in_use; });
+        EXPECT_EQ(used, pool.used_chunks());
+        EXPECT_EQ(pool.num_chunks() - used, pool.unused_chunks());
+        EXPECT_EQ(pool.size() - pool.used_mem(), pool.free_mem());
+    };
+
+    auto c1 = m_pool.request(100);
+    auto c2 = m_pool.request(100);
+    auto c3 = m_pool.request(100, 0, pool_t::lifetime::long_lived);
+    check();
+    auto c4 = c1.split(50);
+    check();
+    c2.release();
+    check();
+    c4.resize(120);
+    check();
+    auto c5 = c4.split(60);
+    check();
+    EXPECT_TRUE(m_pool.try_merge(c4, std::move(c5)));
+    check();
+    c3.consume(10);
+    c1.shrink(20);
+    check();
+    EXPECT_EQ(20 + 120 + 90, pool.used_mem());
+}
+
+static_assert(std::is_nothrow_move_constructible<
+                  buffer_pool<buffer_pool_test::span_t>::Chunk>::value,
+              "Chunks are moved without copying in containers");
+
+TEST_F(buffer_pool_test, MoveChunk)
+{
+    auto c1 = m_pool.request(10);
+    auto c2 = std::move(c1);
+    EXPECT_FALSE(c1.valid());
+    EXPECT_TRUE(c2.valid());
+    EXPECT_EQ(10, c2.m_chunk.size());
+    EXPECT_EQ(10, m_pool.used_mem());
+}
+
+TEST_F(buffer_pool_test, MoveAssignmentReleasesTarget)
+{
+    auto c1 = m_pool.request(10);
+    auto c2 = m_pool.request(20);
+    c1 = std::move(c2);
+
+    EXPECT_FALSE(c2.valid());
+    EXPECT_EQ(20, c1.m_chunk.size());
+    EXPECT_EQ(20, m_pool.used_mem());
+    EXPECT_EQ(1, m_pool.used_chunks());
+}
+
+TEST_F(buffer_pool_test, CompactChunk)
+{
+    static_assert(sizeof(pool_t::compact_chunk) == 8, "");
+
+    auto c = m_pool.request(10);
+    c.m_chunk[0] = 42;
+    const auto handle = m_pool.compact(std::move(c));
+    EXPECT_FALSE(c.valid());
+    EXPECT_EQ(10, m_pool.used_mem());
+    EXPECT_EQ(10, m_pool.data(handle).size());
+    EXPECT_EQ(42, m_pool.data(handle)[0]);
+
+    auto expanded = m_pool.expand(handle);
+    EXPECT_EQ(m_pool.data(handle).data(), expanded.m_chunk.data());
+    EXPECT_EQ(10, expanded.m_chunk.size());
+
+    m_pool.release(m_pool.compact(std::move(expanded)));
+    EXPECT_EQ(0, m_pool.used_mem());
+    EXPECT_EQ(0, m_pool.used_chunks());
+}
+
+TEST_F(hardened_pool_test, CanariesSurroundChunks)
+{
+    const auto g = recording_policy::guard_size;
+    auto c1 = m_pool.request(10);
+    auto c2 = m_pool.request(20);
+
+    EXPECT_EQ(10, c1.m_chunk.size());
+    EXPECT_EQ(m_memory + g, c1.m_chunk.data());
+    EXPECT_EQ(c1.m_chunk.data() + pool_t::footprint(10), c2.m_chunk.data());
+    EXPECT_EQ(30 + 4 * g, m_pool.used_mem());
+
+    c1.shrink(5);
+    c2.release();
+    auto c3 = m_pool.request(3);
+    EXPECT_EQ(c1.m_chunk.data() + pool_t::footprint(5), c3.m_chunk.data());
+
+    EXPECT_EQ(0, m_pool.check_integrity());
+    EXPECT_TRUE(recording_policy::reports.empty());
+}
+
+#ifndef BUFFER_POOL_ASAN
+// These tests corrupt the pool on purpose, which AddressSanitizer reports
+// before the canaries are checked.
+TEST_F(hardened_pool_test, DetectOverrunOnRelease)
+{
+    auto c1 = m_pool.request(10);
+    auto c2 = m_pool.request(10);
+
+    c1.m_chunk.data()[10] = 0;
+    EXPECT_EQ(1, m_pool.check_integrity());
+
+    c1.release();
+    ASSERT_EQ(2, recording_policy::reports.size());
+    EXPECT_EQ("back canary damaged", recording_policy::reports.back());
+}
+
+TEST_F(hardened_pool_test, DetectUnderrunOnShrink)
+{
+    auto c1 = m_pool.request(10);
+
+    c1.m_chunk.data()[-1] = 0;
+    c1.shrink(5);
+    ASSERT_EQ(1, recording_policy::reports.size());
+    EXPECT_EQ("front canary damaged", recording_policy::reports.back());
+}
+
+TEST_F(hardened_pool_test, ResizeMovesCanaries)
+{
+    auto c1 = m_pool.request(10);
+    auto c2 = m_pool.request(10);
+    auto c3 = m_pool.request(10);
+    c1.release();
+
+    c2.resize(20);
+    c3.resize(40);
+    c2.resize(100);
+    EXPECT_EQ(0, m_pool.check_integrity());
+    EXPECT_TRUE(recording_policy::reports.empty());
+}
+
+TEST_F(hardened_pool_test, ConsumeMovesFrontCanary)
+{
+    auto c1 = m_pool.request(10);
+    auto c2 = m_pool.request(30);
+    c2.consume(5);
+    c1.release();
+    c2.consume(20);
+
+    EXPECT_EQ(0, m_pool.check_integrity());
+    EXPECT_TRUE(recording_policy::reports.empty());
+    c2.m_chunk.data()[-1] = 0;
+    c2.release();
+    EXPECT_EQ(1, recording_policy::reports.size());
+}
+
+TEST_F(hardened_pool_test, DetectWriteAfterRelease)
+{
+    auto c1 = m_pool.request(10);
+    auto c2 = m_pool.request(10);
+    const auto data = c1.m_chunk.data();
+
+    c1.release();
+    EXPECT_EQ(0, m_pool.check_integrity());
+
+    data[3] = 42;
+    EXPECT_EQ(1, m_pool.check_integrity());
+    EXPECT_EQ("released memory was modified", recording_policy::reports.back());
+
+    // Handing out the modified memory again is reported as well.
+    auto c3 = m_pool.request(10);
+    EXPECT_EQ(2, recording_policy::reports.size());
+}
+#endif
+
+TEST_F(tagged_pool_test, DumpLiveChunks)
+{
+    m_pool.set_tag_name(2, "rx");
+    auto c1 = m_pool.request(10, 1);
+    auto c2 = m_pool.request(20, 2);
+    auto c3 = m_pool.request(30);
+    c1.release();
+
+    std::ostringstream expected;
+    expected << "offset " << pool_t::footprint(10) << " size 20 tag 2 (rx)\n"
+             << "offset " << pool_t::footprint(10) + pool_t::footprint(20)
+             << " size 30 tag 0\n"
+             << "2 live chunks, 50 bytes\n";
+    std::ostringstream os;
+    m_pool.dump_live_chunks(os);
+    EXPECT_EQ(expected.str(), os.str());
+}
+
+TEST_F(featured_pool_test, DumpHeapMap)
+{
+    auto c1 = m_pool.request(10, 1);
+    auto c2 = m_pool.request(20, 2);
+    auto c3 = m_pool.request(30, 0, pool_t::lifetime::long_lived);
+    c1.release();
+
+    const size_t b1 = pool_t::footprint(10);
+    const size_t b2 = pool_t::footprint(20);
+    const size_t b3 = pool_t::footprint(30);
+    std::ostringstream expected;
+    expected << "{\"size\":1024,\"blocks\":[[0," << b1 << ",0,1],[" << b1
+             << ',' << b2 << ",1,2],[" << b1 + b2 << ','
+             << 1024 - b1 - b2 - b3 << ",0,0],[" << 1024 - b3 << ',' << b3
+             << ",1,0]]}\n";
+    std::ostringstream os;
+    m_pool.dump_heap_map(os);
+    EXPECT_EQ(expected.str(), os.str());
+}
+
+TEST_F(tagged_pool_test, AccountUsagePerTag)
+{
+    auto c1 = m_pool.request(10, 1);
+    auto c2 = m_pool.request(20, 1);
+    auto c3 = m_pool.request(30, 2);
+
+    EXPECT_EQ(30, m_pool.usage(1).used);
+    EXPECT_EQ(2, m_pool.usage(1).chunks);
+    EXPECT_EQ(30, m_pool.usage(2).used);
+    EXPECT_EQ(0, m_pool.usage(3).used);
+    EXPECT_EQ(3, m_pool.num_tags());
+
+    c2.shrink(5);
+    EXPECT_EQ(15, m_pool.usage(1).used);
+    EXPECT_EQ(30, m_pool.usage(1).peak);
+
+    c1.release();
+    EXPECT_EQ(5, m_pool.usage(1).used);
+    EXPECT_EQ(1, m_pool.usage(1).chunks);
+}
+
+TEST_F(tagged_pool_test, TagsBeyondMaxTagsAreNotAccounted)
+{
+    const uint32_t tag = 0xFFFFFFFF;
+    auto c = m_pool.request(10, tag);
+    EXPECT_EQ(0, m_pool.usage(tag).used);
+    EXPECT_EQ(0, m_pool.num_tags());
+    EXPECT_THROW(m_pool.set_tag_name(tag, "huge"), std::out_of_range);
+    EXPECT_THROW(m_pool.set_quota(tag, 0, 0), std::out_of_range);
+}
+
+TEST_F(buffer_pool_test, DefaultPolicyAccountsNoTags)
+{
+    auto c = m_pool.request(10, 1);
+    EXPECT_EQ(0, m_pool.usage(1).used);
+    EXPECT_EQ(0, m_pool.num_tags());
+    EXPECT_THROW(m_pool.set_quota(1, 0, 0), std::out_of_range);
+}
+
+TEST_F(tagged_pool_test, EnforceQuotas)
+{
+    std::vector<std::pair<uint32_t, size_t>> exceeded;
+    m_pool.set_soft_quota_handler(
+        [&](uint32_t tag, size_t used) { exceeded.emplace_back(tag, used); });
+    m_pool.set_quota(1, 20, 40);
+
+    auto c1 = m_pool.request(20, 1);
+    EXPECT_TRUE(exceeded.empty());
+
+    auto c2 = m_pool.request(10, 1);
+    ASSERT_EQ(1, exceeded.size());
+    EXPECT_EQ(1, exceeded[0].first);
+    EXPECT_EQ(30, exceeded[0].second);
+
+    EXPECT_THROW(m_pool.request(11, 1), pool_t::quota_exceeded);
+    EXPECT_EQ(1, m_pool.usage(1).soft_exceeded);
+    EXPECT_EQ(1, m_pool.usage(1).rejected);
+    EXPECT_EQ(30, m_pool.used_mem());
+
+    // Other tags are not affected.
+    auto c3 = m_pool.request(100, 2);
+
+    c2.shrink(5);
+    auto c4 = m_pool.request(15, 1);
+    EXPECT_EQ(40, m_pool.usage(1).used);
+}
+
+TEST_F(tagged_pool_test, ResizeRelocationChecksSoftQuotaOnce)
+{
+    std::vector<std::pair<uint32_t, size_t>> exceeded;
+    m_pool.set_soft_quota_handler(
+        [&](uint32_t tag, size_t used) { exceeded.emplace_back(tag, used); });
+    m_pool.set_quota(1, 200, 1000);
+    auto c1 = m_pool.request(100, 1);
+    auto c2 = m_pool.request(100, 1);
+
+    c1.resize(150);
+    ASSERT_EQ(1, exceeded.size());
+    EXPECT_EQ(250, exceeded[0].second);
+    EXPECT_EQ(250, m_pool.usage(1).used);
+    EXPECT_EQ(2, m_pool.usage(1).chunks);
+}
+
+TEST_F(featured_pool_test, UsedWatermarks)
+{
+    std::vector<bool> signals;
+    m_pool.set_used_watermarks(100, 50,
+                               [&](bool pressure) { signals.push_back(pressure); });
+
+    auto c1 = m_pool.request(60);
+    auto c2 = m_pool.request(30);
+    EXPECT_TRUE(signals.empty());
+
+    auto c3 = m_pool.request(10);
+    EXPECT_EQ(std::vector<bool>{true}, signals);
+    EXPECT_TRUE(m_pool.under_pressure());
+
+    // Hysteresis: no signal between the watermarks.
+    c3.release();
+    c2.shrink(20);
+    EXPECT_EQ(1, signals.size());
+
+    c1.release();
+    EXPECT_EQ((std::vector<bool>{true, false}), signals);
+    EXPECT_FALSE(m_pool.under_pressure());
+}
+
+TEST_F(featured_pool_test, LargestFreeWatermarks)
+{
+    std::vector<bool> signals;
+    m_pool.set_largest_free_watermarks(
+        300, 450, [&](bool pressure) { signals.push_back(pressure); });
+
+    auto c1 = m_pool.request(400);
+    auto c2 = m_pool.request(400);
+    EXPECT_EQ(1024 - 2 * pool_t::footprint(400) - overhead,
+              m_pool.largest_free());
+    EXPECT_EQ(std::vector<bool>{true}, signals);
+
+    // Freeing the first Chunk leaves a hole of 400 bytes, still below high.
+    c1.release();
+    EXPECT_EQ(400, m_pool.largest_free());
+    EXPECT_EQ(1, signals.size());
+
+    c2.shrink(100);
+    EXPECT_EQ(1024 - pool_t::footprint(400) - pool_t::footprint(100) - overhead,
+              m_pool.largest_free());
+    EXPECT_EQ((std::vector<bool>{true, false}), signals);
+}
+
+TEST_F(featured_pool_test, RequestAsyncServedInFifoOrder)
+{
+    std::vector<pool_t::Chunk> served;
+    auto handler = [&](pool_t::Chunk c) { served.push_back(std::move(c)); };
+
+    auto c1 = m_pool.request(1000);
+    m_pool.request_async(500, handler);
+    m_pool.request_async(10, handler);
+    EXPECT_EQ(2, m_pool.num_waiters());
+
+    // Requests do not overtake waiting requests.
+    EXPECT_THROW(m_pool.request(10), std::overflow_error);
+
+    // Enough for the second but not for the first request.
+    c1.shrink(600);
+    EXPECT_TRUE(served.empty());
+
+    c1.release();
+    ASSERT_EQ(2, served.size());
+    EXPECT_EQ(500, served[0].m_chunk.size());
+    EXPECT_EQ(10, served[1].m_chunk.size());
+    EXPECT_EQ(0, m_pool.num_waiters());
+
+    // Served immediately if memory is available.
+    m_pool.request_async(20, handler);
+    EXPECT_EQ(3, served.size());
+}
+
+TEST_F(featured_pool_test, RejectWaitingForTooLargeRequests)
+{
+    EXPECT_THROW(m_pool.request_async(1024, [](pool_t::Chunk) {}),
+                 std::overflow_error);
+    EXPECT_EQ(0, m_pool.num_waiters());
+}
+
+TEST_F(tagged_pool_test, WaitingForQuotaBlocksOnlyTheTag)
+{
+    std::vector<pool_t::Chunk> served;
+    auto handler = [&](pool_t::Chunk c) { served.push_back(std::move(c)); };
+    m_pool.set_quota(1, 100, 100);
+    auto c1 = m_pool.request(80, 1);
+    m_pool.request_async(50, handler, 1);
+    EXPECT_EQ(1, m_pool.num_waiters());
+
+    // Other tags do not wait for the quota of tag 1, but tag 1 does.
+    auto c2 = m_pool.request(100, 2);
+    m_pool.request_async(100, handler, 2);
+    EXPECT_EQ(1, served.size());
+    EXPECT_THROW(m_pool.request(10, 1), std::overflow_error);
+
+    // Requests waiting for memory block all tags.
+    auto c3 = m_pool.request(600, 2);
+    m_pool.request_async(300, handler, 3);
+    EXPECT_THROW(m_pool.request(10, 2), std::overflow_error);
+
+    // The request of tag 1 is served once its quota allows it.
+    c1.release();
+    ASSERT_EQ(2, served.size());
+    EXPECT_EQ(50, served[1].m_chunk.size());
+    EXPECT_EQ(1, m_pool.num_waiters());
+
+    c3.release();
+    ASSERT_EQ(3, served.size());
+    EXPECT_EQ(300, served[2].m_chunk.size());
+}
+
+TEST_F(featured_pool_test, WaitingRequestsBlockRequests)
+{
+    std::vector<pool_t::Chunk> served;
+    auto c1 = m_pool.request(600);
+    m_pool.request_async(
+        500, [&](pool_t::Chunk c) { served.push_back(std::move(c)); });
+
+    // Plenty of memory is free, but the waiting request comes first.
+    EXPECT_EQ(424, m_pool.free_mem());
+    EXPECT_THROW(m_pool.request(10), std::overflow_error);
+
+    // The handler is called by the release.
+    c1.release();
+    ASSERT_EQ(1, served.size());
+    EXPECT_NO_THROW(m_pool.request(10));
+}
+
+TEST_F(buffer_pool_test, SubPool)
+{
+    auto other = m_pool.request(10);
+    {
+        pool_t sub(m_pool.request(100));
+        EXPECT_EQ(100, sub.size());
+        EXPECT_EQ(110, m_pool.used_mem());
+
+        auto c1 = sub.request(60);
+        EXPECT_EQ(other.m_chunk.data() + pool_t::footprint(10),
+                  c1.m_chunk.data());
+        EXPECT_EQ(60, sub.used_mem());
+
+        // The sub-pool grows in place into the free memory of the parent.
+        auto c2 = sub.request(60);
+        EXPECT_EQ(200, sub.size());
+        EXPECT_EQ(210, m_pool.used_mem());
+        EXPECT_EQ(2, m_pool.num_chunks());
+
+        // Unused memory is returned to the parent.
+        c2.release();
+        sub.shrink_to_fit();
+        EXPECT_EQ(pool_t::footprint(60), sub.size());
+        EXPECT_EQ(10 + pool_t::footprint(60), m_pool.used_mem());
+
+        // Growing doubles the size if possible.
+        auto c3 = sub.request(20);
+        EXPECT_EQ(2 * pool_t::footprint(60), sub.size());
+    }
+    // Destroying the sub-pool returns all memory at once.
+    EXPECT_EQ(10, m_pool.used_mem());
+    EXPECT_EQ(1, m_pool.num_chunks());
+}
+
+TEST_F(buffer_pool_test, SubPoolCannotGrowIntoUsedMemory)
+{
+    pool_t sub(m_pool.request(100));
+    auto blocker = m_pool.request(10);
+
+    auto c1 = sub.request(50);
+    EXPECT_THROW(sub.request(60), std::overflow_error);
+    EXPECT_EQ(100, sub.size());
+
+    // A free successor in the parent can be used.
+    blocker.release();
+    auto c2 = sub.request(60);
+    EXPECT_EQ(1, m_pool.used_chunks());
+}
+
+TEST_F(featured_pool_test, SubPoolDoesNotOvertakeWaitingRequests)
+{
+    pool_t sub(m_pool.request(100));
+    m_pool.request_async(950, [](pool_t::Chunk) {});
+
+    auto c1 = sub.request(50);
+    EXPECT_THROW(sub.request(60), std::overflow_error);
+    EXPECT_EQ(100, sub.size());
+    EXPECT_EQ(1, m_pool.num_waiters());
+}
+
+TEST(buffer_pool_locking, ShrinkToFitServesParentWithoutLock)
+{
+    using span_t = gsl::span<uint8_t>;
+    using pool_t = buffer_pool<span_t, checked_lock_policy>;
+    uint8_t memory[1024];
+    pool_t pool(span_t(memory, sizeof(memory)));
+
+    pool_t sub(pool.request(500));
+    auto c1 = sub.request(10);
+    auto blocker = pool.request(500);
+
+    // The handler uses the sub-pool whose memory it receives.
+    pool_t::Chunk served;
+    size_t subUsed = 0;
+    pool.request_async(300, [&](pool_t::Chunk c) {
+        served = std::move(c);
+        subUsed = sub.used_mem();
+    });
+
+    sub.shrink_to_fit();
+    EXPECT_TRUE(served.valid());
+    EXPECT_EQ(10, subUsed);
+}
+
+TEST(buffer_pool_wilderness, PreserveTailForLargeRequests)
+{
+    alignas(8) uint8_t memory[1024];
+    using pool_t = buffer_pool<gsl::span<uint8_t>, small_wilderness_policy>;
+    pool_t pool(gsl::span<uint8_t>(memory, sizeof(memory)));
+    const size_t b300 = pool_t::footprint(300);
+    const size_t b10 = pool_t::footprint(10);
+
+    auto a = pool.request(300);
+    auto b = pool.request(10);
+    auto c = pool.request(300);
+    auto d = pool.request(10);
+    a.release();
+    c.release();
+
+    // Small requests take the first hole, large ones the tail.
+    auto small = pool.request(10);
+    EXPECT_EQ(memory, small.m_chunk.data());
+    auto large = pool.request(256);
+    EXPECT_EQ(memory + 2 * b300 + 2 * b10, large.m_chunk.data());
+
+    // Medium requests take the last hole as before.
+    auto medium = pool.request(100);
+    EXPECT_EQ(memory + b300 + b10, medium.m_chunk.data());
+
+    // Large requests fall back to holes if the tail is too small.
+    auto large2 = pool.request(280);
+    EXPECT_EQ(memory + b10, large2.m_chunk.data());
+}
+
+TEST_F(buffer_pool_test, DefaultPolicyIgnoresLifetime)
+{
+    const size_t b100 = pool_t::footprint(100);
+    auto a = m_pool.request(100);
+    auto b = m_pool.request(100, 0, pool_t::lifetime::long_lived);
+    EXPECT_EQ(m_memory + b100, b.m_chunk.data());
+    EXPECT_EQ(1024 - 2 * b100 - overhead, m_pool.largest_free());
+}
+
+TEST_F(featured_pool_test, LongLivedChunksAtTheEnd)
+{
+    const auto longLived = pool_t::lifetime::long_lived;
+    const size_t b100 = pool_t::footprint(100);
+    auto a = m_pool.request(100);
+    auto b = m_pool.request(100, 0, longLived);
+    auto c = m_pool.request(100, 0, longLived);
+    EXPECT_EQ(m_memory, a.m_chunk.data());
+    EXPECT_EQ(m_memory + 1024 - b100, b.m_chunk.data());
+    EXPECT_EQ(m_memory + 1024 - 2 * b100, c.m_chunk.data());
+    EXPECT_EQ(300, m_pool.used_mem());
+    EXPECT_EQ(1024 - 3 * b100 - overhead, m_pool.largest_free());
+
+    // Releasing the long-lived Chunk next to the unused memory returns it,
+    // others leave a hole.
+    b.release();
+    EXPECT_EQ(3, m_pool.num_chunks());
+    c.release();
+    EXPECT_EQ(1, m_pool.num_chunks());
+    EXPECT_EQ(1024 - b100 - overhead, m_pool.largest_free());
+    EXPECT_EQ(0, m_pool.check_integrity());
+}
+
+TEST_F(featured_pool_test, LongLivedChunksUseHolesWhenFull)
+{
+    const auto longLived = pool_t::lifetime::long_lived;
+    auto a = m_pool.request(392, 0, longLived);
+    auto b = m_pool.request(192, 0, longLived);
+    auto c = m_pool.request(392);
+    a.release();
+
+    // The hole at the end is used by short-lived Chunks if the unused memory
+    // is too small ...
+    auto d = m_pool.request(300);
+    EXPECT_EQ(m_memory + 1024 - pool_t::footprint(392), d.m_chunk.data());
+
+    // ... and by long-lived ones.
+    auto e = m_pool.request(50, 0, longLived);
+    EXPECT_EQ(d.m_chunk.data() + pool_t::footprint(300), e.m_chunk.data());
+    EXPECT_EQ(0, m_pool.check_integrity());
+
+    std::vector<pool_t::block_info> blocks;
+    m_pool.for_each_block(
+        [&](const pool_t::block_info& i) { blocks.push_back(i); });
+    ASSERT_EQ(6, blocks.size());
+    // The unused memory.
+    EXPECT_EQ(pool_t::footprint(392), blocks[1].offset);
+    EXPECT_EQ(1024 - 2 * pool_t::footprint(392) - pool_t::footprint(192),
+              blocks[1].size);
+    EXPECT_EQ(0, blocks[1].in_use);
+}
+
+TEST_F(featured_pool_test, ReadyListsForCommonSizes)
+{
+    m_pool.set_ready_lists(1, 4);
+    for (int i = 0; i < 10; ++i) m_pool.request(32);
+    m_pool.request(100);
+    EXPECT_EQ(0, m_pool.ready_list_stats().hits);
+    EXPECT_EQ(11, m_pool.ready_list_stats().misses);
+
+    m_pool.maintain();
+    EXPECT_EQ(4, m_pool.ready_list_stats().blocks);
+    EXPECT_EQ(4 * pool_t::footprint(32), m_pool.ready_list_stats().bytes);
+    EXPECT_EQ(0, m_pool.used_mem());
+
+    auto c = m_pool.request(32);
+    EXPECT_EQ(1, m_pool.ready_list_stats().hits);
+    EXPECT_EQ(3, m_pool.ready_list_stats().blocks);
+    EXPECT_EQ(32, m_pool.used_mem());
+    EXPECT_EQ(0, m_pool.check_integrity());
+
+    // The remaining ready blocks behind c are merged.
+    m_pool.set_ready_lists(0, 0);
+    EXPECT_EQ(0, m_pool.ready_list_stats().blocks);
+    EXPECT_EQ(2, m_pool.num_chunks());
+}
+
+TEST_F(featured_pool_test, ReleasedChunksRefillReadyLists)
+{
+    m_pool.set_ready_lists(1, 2);
+    m_pool.request(32);
+    m_pool.maintain();
+    auto c1 = m_pool.request(32);
+    auto c2 = m_pool.request(32);
+    const auto first = c1.m_chunk.data();
+    EXPECT_EQ(0, m_pool.ready_list_stats().blocks);
+
+    // Other sizes do not use the ready blocks.
+    c1.release();
+    auto other = m_pool.request(16);
+    EXPECT_NE(first, other.m_chunk.data());
+    EXPECT_EQ(1, m_pool.ready_list_stats().blocks);
+
+    auto c3 = m_pool.request(32);
+    EXPECT_EQ(first, c3.m_chunk.data());
+    EXPECT_EQ(3, m_pool.ready_list_stats().hits);
+    EXPECT_EQ(0, m_pool.check_integrity());
+}
+
+TEST_F(featured_pool_test, ReadyBlocksReturnedWhenNeeded)
+{
+    m_pool.set_ready_lists(1, 16);
+    m_pool.request(48);
+    m_pool.maintain();
+    EXPECT_EQ(16, m_pool.ready_list_stats().blocks);
+
+    // The ready blocks are merged again to satisfy the request.
+    auto c = m_pool.request(1000);
+    EXPECT_EQ(0, m_pool.ready_list_stats().blocks);
+    EXPECT_EQ(1, m_pool.num_chunks());
+}
+
+TEST_F(featured_pool_test, QuickListsReuseReleasedChunks)
+{
+    m_pool.set_quick_lists(64, 2);
+    auto a = m_pool.request(32);
+    auto b = m_pool.request(32);
+    auto c = m_pool.request(32);
+    auto big = m_pool.request(100);
+    const auto first = a.m_chunk.data();
+
+    // Small Chunks are kept unmerged ...
+    a.release();
+    b.release();
+    EXPECT_EQ(4, m_pool.num_chunks());
+    EXPECT_EQ(2, m_pool.ready_list_stats().blocks);
+
+    // ... unless their list is full ...
+    c.release();
+    EXPECT_EQ(4, m_pool.num_chunks());
+    EXPECT_EQ(2, m_pool.ready_list_stats().blocks);
+
+    // ... or they are large.
+    big.release();
+    EXPECT_EQ(2, m_pool.num_chunks());
+
+    auto d = m_pool.request(32);
+    EXPECT_EQ(1, m_pool.ready_list_stats().hits);
+    auto e = m_pool.request(32);
+    EXPECT_EQ(first, e.m_chunk.data());
+    EXPECT_EQ(0, m_pool.check_integrity());
+}
+
+TEST_F(featured_pool_test, QuickListsConsolidatedUnderPressure)
+{
+    m_pool.set_quick_lists(64, 4);
+    m_pool.set_used_watermarks(100, 50, [](bool) {});
+    auto a = m_pool.request(32);
+    auto b = m_pool.request(32);
+    auto c = m_pool.request(32);
+    auto d = m_pool.request(32);
+    EXPECT_TRUE(m_pool.under_pressure());
+
+    a.release();
+    EXPECT_EQ(0, m_pool.ready_list_stats().blocks);
+    EXPECT_EQ(4, m_pool.num_chunks());
+
+    m_pool.set_quick_lists(0, 0);
+    EXPECT_EQ(4, m_pool.num_chunks());
+}
+
+TEST_F(featured_pool_test, QuickListsForLimitedSizes)
+{
+    m_pool.set_quick_lists(64, 2, 2);
+    auto a = m_pool.request(8);
+    auto b = m_pool.request(16);
+    auto c = m_pool.request(24);
+    auto big = m_pool.request(100);
+
+    a.release();
+    b.release();
+    EXPECT_EQ(2, m_pool.ready_list_stats().blocks);
+
+    // A third size is merged as usual.
+    c.release();
+    EXPECT_EQ(2, m_pool.ready_list_stats().blocks);
+    EXPECT_EQ(0, m_pool.check_integrity());
+}
+
+TEST_F(featured_pool_test, MaintainKeepsQuickLists)
+{
+    m_pool.set_ready_lists(1, 1);
+    m_pool.set_quick_lists(64, 2);
+    for (int i = 0; i < 10; ++i) m_pool.request(100);
+    auto a = m_pool.request(32);
+    const auto first = a.m_chunk.data();
+    a.release();
+
+    // 32 is not common, but its quick list stays next to the ready list.
+    m_pool.maintain();
+    EXPECT_EQ(2, m_pool.ready_list_stats().blocks);
+    auto b = m_pool.request(32);
+    EXPECT_EQ(first, b.m_chunk.data());
+}
+
+TEST(buffer_pool_threadsafe, RequestWaitForRelease)
+{
+    using span_t = gsl::span<uint8_t>;
+    using pool_t = buffer_pool<span_t, threadsafe_pool_policy>;
+    uint8_t memory[128];
+    pool_t pool(span_t(memory, sizeof(memory)));
+
+    auto c1 = pool.request(100);
+    std::thread releaser([&] {
+        while (pool.num_waiters() == 0) std::this_thread::yield();
+        c1.release();
+    });
+
+    auto c2 = pool.request_wait(64, std::chrono::seconds(10));
+    releaser.join();
+    EXPECT_TRUE(c2.valid());
+    EXPECT_EQ(64, c2.m_chunk.size());
+}
+
+TEST(buffer_pool_threadsafe, RequestWaitTimeout)
+{
+    using span_t = gsl::span<uint8_t>;
+    using pool_t = buffer_pool<span_t, threadsafe_pool_policy>;
+    uint8_t memory[128];
+    pool_t pool(span_t(memory, sizeof(memory)));
+
+    auto c1 = pool.request(100);
+    auto c2 = pool.request_wait(64, std::chrono::milliseconds(10));
+    EXPECT_FALSE(c2.valid());
+    EXPECT_EQ(0, pool.num_waiters());
+}
+
+TEST(buffer_pool_threadsafe, QuotaDoesNotBlockOtherTags)
+{
+    using span_t = gsl::span<uint8_t>;
+    using pool_t = buffer_pool<span_t, threadsafe_tagged_policy>;
+    uint8_t memory[1024];
+    pool_t pool(span_t(memory, sizeof(memory)));
+    pool.set_quota(1, 100, 100);
+    auto c1 = pool.request(100, 1);
+
+    pool_t::Chunk quota;
+    std::thread quotaWaiter(
+        [&] { quota = pool.request_wait(50, std::chrono::seconds(10), 1); });
+    while (pool.num_waiters() == 0) std::this_thread::yield();
+
+    // Tag 2 allocates while tag 1 waits for its quota ...
+    std::thread allocator([&] {
+        for (int i = 0; i < 1000; ++i) EXPECT_NO_THROW(pool.request(100, 2));
+    });
+    allocator.join();
+
+    // ... and waits for memory.
+    auto c2 = pool.request(800, 2);
+    pool_t::Chunk memory2;
+    std::thread memoryWaiter(
+        [&] { memory2 = pool.request_wait(500, std::chrono::seconds(10), 2); });
+    while (pool.num_waiters() < 2) std::this_thread::yield();
+    EXPECT_THROW(pool.request(10, 3), std::overflow_error);
+
+    c2.release();
+    memoryWaiter.join();
+    EXPECT_TRUE(memory2.valid());
+    EXPECT_EQ(1, pool.num_waiters());
+
+    c1.release();
+    quotaWaiter.join();
+    EXPECT_TRUE(quota.valid());
+    EXPECT_EQ(50, pool.usage(1).used);
+    EXPECT_EQ(500, pool.usage(2).used);
+}
+
+TEST(buffer_pool_stats, StatsSnapshot)
+{
+    using span_t = gsl::span<uint8_t>;
+    uint8_t memory[1024];
+    buffer_pool<span_t, monitored_policy> pool(span_t(memory, sizeof(memory)));
+
+    auto c1 = pool.request(100);
+    auto c2 = pool.request(200);
+    c1.release();
+    EXPECT_THROW(pool.request(1000), std::overflow_error);
+
+    const auto s = pool.stats_snapshot();
+    EXPECT_EQ(1024, s.size);
+    EXPECT_EQ(200, s.used);
+    EXPECT_EQ(1, s.used_chunks);
+    EXPECT_EQ(1, s.unused_chunks);
+    EXPECT_EQ(2, s.requests);
+    EXPECT_EQ(1, s.failures);
+    EXPECT_EQ(1, s.releases);
+}
+
+// The snapshot is read by another thread while the pool, which is not
+// threadsafe, is used by its owner.
+TEST(buffer_pool_stats, StatsSnapshotFromOtherThread)
+{
+    using span_t = gsl::span<uint8_t>;
+    using pool_t = buffer_pool<span_t, monitored_policy>;
+    uint8_t memory[2048];
+    pool_t pool(span_t(memory, sizeof(memory)));
+
+    std::atomic<bool> done{false};
+    size_t inconsistent = 0;
+    std::thread reader([&] {
+        while (!done)
+        {
+            const auto s = pool.stats_snapshot();
+            if (s.used_chunks != s.requests - s.releases ||
+                s.used != 10 * s.used_chunks)
+                ++inconsistent;
+        }
+    });
+
+    std::vector<pool_t::Chunk> chunks;
+    for (int i = 0; i < 100000; ++i)
+    {
+        if (chunks.size() < 50 && i % 3 != 0)
+            chunks.push_back(pool.request(10));
+        else if (!chunks.empty())
+            chunks.erase(chunks.begin() + i % chunks.size());
+    }
+    done = true;
+    reader.join();
+    EXPECT_EQ(0, inconsistent);
+}
+
+TEST(buffer_pool_stats, SplitAndMergeKeepStatsBalanced)
+{
+    using span_t = gsl::span<uint8_t>;
+    uint8_t memory[1024];
+    buffer_pool<span_t, counted_policy> pool(span_t(memory, sizeof(memory)));
+
+    auto c1 = pool.request(30);
+    auto c2 = c1.split(10);
+    auto c3 = c2.split(5);
+    EXPECT_EQ(3, pool.stats_snapshot().requests);
+    EXPECT_EQ(3, pool.costs().requests);
+
+    EXPECT_TRUE(pool.try_merge(c2, std::move(c3)));
+    c1.release();
+    c2.release();
+
+    const auto s = pool.stats_snapshot();
+    EXPECT_EQ(0, s.used_chunks);
+    EXPECT_EQ(s.requests, s.releases);
+    const auto costs = pool.costs();
+    EXPECT_EQ(costs.requests, costs.releases);
+}
+
+TEST(buffer_pool_stats, CostStats)
+{
+    using span_t = gsl::span<uint8_t>;
+    uint8_t memory[1024];
+    buffer_pool<span_t, costed_policy> pool(span_t(memory, sizeof(memory)));
+
+    auto c1 = pool.request(100);
+    auto c2 = pool.request(200);
+    auto c3 = pool.request(300);
+    c2.release();
+    c1.release();
+    auto c4 = pool.request(250);
+    EXPECT_THROW(pool.request(1000), std::overflow_error);
+    c3.release();
+    c4.release();
+
+    const auto costs = pool.costs();
+    EXPECT_EQ(5, costs.requests);
+    EXPECT_EQ(8, costs.searched);
+    EXPECT_EQ(3, costs.max_searched);
+    EXPECT_EQ(1, costs.search_histogram[0]);
+    EXPECT_EQ(1, costs.search_histogram[1]);
+    EXPECT_EQ(3, costs.search_histogram[2]);
+    EXPECT_LT(0, costs.moved_bytes);
+    EXPECT_EQ(4, costs.releases);
+    // c1 merged with c2, c3 with the rest of their block and the unused
+    // memory, and c4 with the unused memory.
+    EXPECT_EQ(4, costs.merges);
+
+    pool.reset_costs();
+    EXPECT_EQ(0, pool.costs().requests);
+    EXPECT_EQ(0, pool.costs().search_histogram[2]);
+}
+
+TEST(buffer_pool_tracing, TraceOperations)
+{
+    using span_t = gsl::span<uint8_t>;
+    alignas(8) uint8_t memory[160];
+    using pool_t = buffer_pool<span_t, tracing_policy>;
+    pool_t pool(span_t(memory, sizeof(memory)));
+    auto& events = tracing_policy::events;
+    events.clear();
+
+    auto c1 = pool.request(10);
+    auto c2 = pool.request(20);
+    auto c3 = pool.request(30);
+    c1.release();
+    c2.release();
+    auto c4 = pool.request(25);
+    c4.shrink(5);
+    c4.resize(50);
+    EXPECT_THROW(pool.request(100), std::overflow_error);
+
+    ASSERT_EQ(10, events.size());
+    EXPECT_EQ(pool_event::request, events[0].type);
+    EXPECT_EQ(memory, events[0].chunk);
+    EXPECT_EQ(10, events[0].size);
+    EXPECT_EQ(0, events[0].searched);
+    EXPECT_EQ(pool_event::release, events[3].type);
+    EXPECT_EQ(10, events[3].size);
+
+    // The request searched c3 and the free mgm_chunk in front of it.
+    EXPECT_EQ(pool_event::request, events[5].type);
+    EXPECT_EQ(memory, events[5].chunk);
+    EXPECT_EQ(2, events[5].searched);
+    EXPECT_EQ(pool_event::shrink, events[6].type);
+    EXPECT_EQ(5, events[6].size);
+
+    // c4 cannot grow in place, so it is moved behind c3, which is no
+    // request of the user.
+    EXPECT_EQ(pool_event::resize, events[7].type);
+    const size_t behind = pool_t::footprint(10) + pool_t::footprint(20) +
+                          pool_t::footprint(30);
+    EXPECT_EQ(memory + behind, events[7].chunk);
+    EXPECT_EQ(50, events[7].size);
+    EXPECT_EQ(pool_event::release, events[8].type);
+    EXPECT_EQ(memory, events[8].chunk);
+
+    // Failed requests are reported without a Chunk.
+    EXPECT_EQ(pool_event::request, events[9].type);
+    EXPECT_EQ(nullptr, events[9].chunk);
+    EXPECT_EQ(100, events[9].size);
+}
+
+TEST(buffer_pool_tracing, TraceServedRequestsOnly)
+{
+    using span_t = gsl::span<uint8_t>;
+    using pool_t = buffer_pool<span_t, tracing_policy>;
+    uint8_t memory[128];
+    pool_t pool(span_t(memory, sizeof(memory)));
+    auto& events = tracing_policy::events;
+    std::vector<pool_t::Chunk> served;
+
+    auto c1 = pool.request(100);
+    events.clear();
+    pool.request_async(50,
+                       [&](pool_t::Chunk c) { served.push_back(std::move(c)); });
+
+    // Attempts to serve the waiting request are not traced as requests.
+    c1.shrink(90);
+    c1.release();
+    ASSERT_EQ(1, served.size());
+    ASSERT_EQ(3, events.size());
+    EXPECT_EQ(pool_event::shrink, events[0].type);
+    EXPECT_EQ(pool_event::release, events[1].type);
+    EXPECT_EQ(pool_event::request, events[2].type);
+    EXPECT_EQ(served[0].m_chunk.data(), events[2].chunk);
+    EXPECT_EQ(50, events[2].size);
+}
+
+TEST(buffer_pool_leaks, ReportLeakedChunksOnDestruction)
+{
+    using span_t = gsl::span<uint8_t>;
+    using pool_t = buffer_pool<span_t, leak_recording_policy>;
+    uint8_t memory[128];
+    leak_recording_policy::leaks.clear();
+
+    // The leaked Chunk is never destroyed, as it would access the dead pool.
+    alignas(pool_t::Chunk) uint8_t storage[sizeof(pool_t::Chunk)];
+    {
+        pool_t pool(span_t(memory, sizeof(memory)));
+        auto c1 = pool.request(10, 1);
+        new (storage) pool_t::Chunk(pool.request(20, 7));
+    }
+
+    ASSERT_EQ(1, leak_recording_policy::leaks.size());
+    EXPECT_EQ(20, leak_recording_policy::leaks[0].first);
+    EXPECT_EQ(7, leak_recording_policy::leaks[0].second);
+}
+
+#ifdef BUFFER_POOL_ASAN
+// Memory which does not belong to a Chunk is poisoned for AddressSanitizer.
+TEST_F(buffer_pool_test, AsanReportsOverflowIntoFreeMemory)
+{
+    auto c = m_pool.request(16);
+    EXPECT_DEATH(c.m_chunk.data()[16] = 1, "use-after-poison");
+}
+
+TEST_F(buffer_pool_test, AsanReportsUseAfterRelease)
+{
+    auto c1 = m_pool.request(16);
+    auto c2 = m_pool.request(16);
+    const auto data = c1.m_chunk.data();
+
+    c1.release();
+    EXPECT_DEATH(data[0] = 1, "use-after-poison");
+
+    // Once the memory is handed out again, it can be used.
+    auto c3 = m_pool.request(16);
+    c3.m_chunk.data()[0] = 1;
+}
+
+// The redzones separate Chunks of any size.
+TEST_F(buffer_pool_test, AsanReportsOverflowIntoLiveChunk)
+{
+    auto c1 = m_pool.request(13);
+    auto c2 = m_pool.request(13);
+    const auto gap = c2.m_chunk.data() - c1.m_chunk.data();
+
+    EXPECT_DEATH(c1.m_chunk.data()[13] = 1, "use-after-poison");
+    EXPECT_DEATH(c1.m_chunk.data()[gap - 1] = 1, "use-after-poison");
+}
+
+TEST_F(buffer_pool_test, AsanReportsUseAfterReleaseNextToLiveChunk)
+{
+    auto c1 = m_pool.request(13);
+    auto c2 = m_pool.request(13);
+    const auto data = c1.m_chunk.data();
+
+    c1.release();
+    EXPECT_DEATH(data[12] = 1, "use-after-poison");
+    c2.m_chunk.data()[0] = 1;
+}
+
+TEST_F(buffer_pool_test, AsanReportsAccessBehindShrunkChunk)
+{
+    auto c1 = m_pool.request(32);
+    auto c2 = m_pool.request(16);
+
+    c1.shrink(8);
+    EXPECT_DEATH(c1.m_chunk.data()[8] = 1, "use-after-poison");
+}
+
+TEST_F(hardened_pool_test, AsanReportsOverflowIntoCanary)
+{
+    auto c = m_pool.request(16);
+    EXPECT_DEATH(c.m_chunk.data()[16] = 1, "use-after-poison");
 }
+#endif
@@ -6,19 +6,40 @@
 
 #include <buffer_pool.hpp>
 
+// A policy enabling the features which cost a check per operation.
+struct featured_pool_policy : default_pool_policy
+{
+    static constexpr bool place_by_lifetime = true;
+    static constexpr bool wait_for_memory = true;
+    static constexpr bool watermarks = true;
+    static constexpr bool ready_lists = true;
+};
 
-class buffer_pool_test : public ::testing::Test
+template <class POLICY>
+class basic_pool_test : public ::testing::Test
 {
 public:
-    buffer_pool_test() : m_span(m_memory, sizeof(m_memory)), m_pool(m_span) {}
+    basic_pool_test() : m_span(m_memory, sizeof(m_memory)), m_pool(m_span) {}
     using span_t = gsl::span<uint8_t>;
 
 protected:
-    uint8_t m_memory[1024] = {0};
+    alignas(8) uint8_t m_memory[1024] = {0};
     span_t m_span;
 
-    using pool_t = buffer_pool<span_t>;
+    using pool_t = buffer_pool<span_t, POLICY>;
     pool_t m_pool;
+
+    // The memory taken by a Chunk beyond its size, if the size is a multiple
+    // of 8. Non-zero under AddressSanitizer, which pads blocks with redzones.
+    static constexpr size_t overhead = pool_t::footprint(8) - 8;
+};
+
+class buffer_pool_test : public basic_pool_test<default_pool_policy>
+{
+};
+
+class featured_pool_test : public basic_pool_test<featured_pool_policy>
+{
 };
 
 #endif  // TESTS_H
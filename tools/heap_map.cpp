@@ -0,0 +1,255 @@
+// Renders a heap map written by buffer_pool::dump_heap_map and computes
+// fragmentation statistics:
+//
+//     heap_map [--svg] [--width N] [--rows N] [FILE]
+//
+// Reads the heap map from FILE or stdin. Without --svg, an ASCII map is
+// written, one character per cell: '#' is in use, '.' is free and '+' is
+// both. With --svg, an SVG image with one rectangle per block is written and
+// the statistics go to stderr.
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+namespace
+{
+struct block
+{
+    uint64_t offset;
+    uint64_t size;
+    bool in_use;
+    uint32_t tag;
+};
+
+struct heap_map
+{
+    uint64_t size = 0;
+    std::vector<block> blocks;  // Covering the whole memory.
+};
+
+// Parses the unsigned integers following key in text.
+std::vector<uint64_t> numbers_after(const std::string& text, const char* key)
+{
+    const auto pos = text.find(key);
+    if (pos == std::string::npos)
+        throw std::runtime_error(std::string("missing ") + key);
+
+    std::vector<uint64_t> numbers;
+    const char* p = text.c_str() + pos + std::strlen(key);
+    while (*p != '\0' && *p != '}')
+    {
+        if (*p >= '0' && *p <= '9')
+        {
+            char* end = nullptr;
+            numbers.push_back(std::strtoull(p, &end, 10));
+            p = end;
+        }
+        else
+        {
+            ++p;
+        }
+    }
+    return numbers;
+}
+
+heap_map read_map(std::istream& is)
+{
+    const std::string text((std::istreambuf_iterator<char>(is)),
+                           std::istreambuf_iterator<char>());
+    heap_map map;
+    const auto size = numbers_after(text, "\"size\":");
+    if (size.empty()) throw std::runtime_error("missing size");
+    map.size = size.front();
+
+    const auto fields = numbers_after(text, "\"blocks\":");
+    if (fields.size() % 4 != 0)
+        throw std::runtime_error("blocks need 4 fields");
+
+    uint64_t end = 0;
+    for (size_t i = 0; i < fields.size(); i += 4)
+    {
+        const block b{fields[i], fields[i + 1], fields[i + 2] != 0,
+                      static_cast<uint32_t>(fields[i + 3])};
+        if (b.offset != end || b.offset + b.size > map.size)
+            throw std::runtime_error("blocks do not cover the memory");
+        map.blocks.push_back(b);
+        end = b.offset + b.size;
+    }
+    // The memory behind the last block is free.
+    if (end < map.size)
+        map.blocks.push_back(block{end, map.size - end, false, 0});
+    return map;
+}
+
+void print_stats(const heap_map& map, std::ostream& os)
+{
+    uint64_t used = 0, free = 0, largest = 0;
+    size_t usedBlocks = 0, freeBlocks = 0;
+    // Free blocks by size class: < 16, < 32, ... bytes.
+    std::vector<size_t> classes;
+    for (const auto& b : map.blocks)
+    {
+        if (b.in_use)
+        {
+            used += b.size;
+            ++usedBlocks;
+            continue;
+        }
+        free += b.size;
+        ++freeBlocks;
+        largest = std::max(largest, b.size);
+
+        size_t c = 0;
+        while (c < 63 && (uint64_t(16) << c) <= b.size) ++c;
+        if (classes.size() <= c) classes.resize(c + 1);
+        ++classes[c];
+    }
+
+    os << "size           " << map.size << '\n'
+       << "used           " << used << " bytes in " << usedBlocks
+       << " blocks\n"
+       << "free           " << free << " bytes in " << freeBlocks
+       << " blocks\n"
+       << "largest free   " << largest << '\n'
+       << "fragmentation  "
+       << (free != 0 ? 1.0 - double(largest) / double(free) : 0.0) << '\n';
+    for (size_t c = 0; c < classes.size(); ++c)
+        if (classes[c] != 0)
+            os << "free < " << (uint64_t(16) << c) << "\t" << classes[c]
+               << '\n';
+}
+
+void print_ascii(const heap_map& map, size_t width, size_t rows,
+                 std::ostream& os)
+{
+    const size_t cells = width * rows;
+    const uint64_t cellSize =
+        std::max<uint64_t>((map.size + cells - 1) / cells, 1);
+    std::vector<uint64_t> usedBytes(cells, 0), freeBytes(cells, 0);
+    for (const auto& b : map.blocks)
+    {
+        const uint64_t last = b.offset + b.size;
+        for (uint64_t first = b.offset; first < last;)
+        {
+            const uint64_t cell = first / cellSize;
+            const uint64_t end = std::min(last, (cell + 1) * cellSize);
+            (b.in_use ? usedBytes : freeBytes)[cell] += end - first;
+            first = end;
+        }
+    }
+
+    for (size_t cell = 0; cell * cellSize < map.size; ++cell)
+    {
+        os << (freeBytes[cell] == 0   ? '#'
+               : usedBytes[cell] == 0 ? '.'
+                                      : '+');
+        if ((cell + 1) % width == 0) os << '\n';
+    }
+    os << "\none cell is " << cellSize << " bytes\n\n";
+}
+
+void print_svg(const heap_map& map, size_t width, size_t rows,
+               std::ostream& os)
+{
+    const size_t rowHeight = 16;
+    const double rowSize = double(map.size) / rows;
+    const double scale = width / rowSize;
+    os << "<svg xmlns=\"http://www.w3.org/2000/svg\" width=\"" << width
+       << "\" height=\"" << rows * rowHeight << "\">\n";
+    for (const auto& b : map.blocks)
+    {
+        // Each tag gets its own hue.
+        std::ostringstream fill;
+        if (b.in_use)
+            fill << "hsl(" << (b.tag * 47) % 360 << ",60%,45%)";
+        else
+            fill << "#eeeeee";
+
+        // Blocks may wrap into the following rows.
+        const double last = b.offset + b.size;
+        for (double first = b.offset; first < last;)
+        {
+            const size_t row = std::min<size_t>(first / rowSize, rows - 1);
+            const double end = std::min(last, (row + 1) * rowSize);
+            os << "<rect x=\"" << (first - row * rowSize) * scale << "\" y=\""
+               << row * rowHeight << "\" width=\"" << (end - first) * scale
+               << "\" height=\"" << rowHeight - 1 << "\" fill=\"" << fill.str()
+               << "\"><title>offset " << b.offset << " size " << b.size
+               << (b.in_use ? " tag " + std::to_string(b.tag) : " free")
+               << "</title></rect>\n";
+            first = end;
+        }
+    }
+    os << "</svg>\n";
+}
+}  // namespace anonymous
+
+int main(int argc, char** argv)
+{
+    bool svg = false;
+    size_t width = 0, rows = 16;
+    const char* path = nullptr;
+    for (int i = 1; i < argc; ++i)
+    {
+        const std::string arg = argv[i];
+        if (arg == "--svg")
+            svg = true;
+        else if (arg == "--width" && i + 1 < argc)
+            width = std::strtoul(argv[++i], nullptr, 10);
+        else if (arg == "--rows" && i + 1 < argc)
+            rows = std::strtoul(argv[++i], nullptr, 10);
+        else if (path == nullptr && arg[0] != '-')
+            path = argv[i];
+        else
+        {
+            std::cerr << "usage: " << argv[0]
+                      << " [--svg] [--width N] [--rows N] [FILE]\n";
+            return 2;
+        }
+    }
+    if (width == 0) width = svg ? 1024 : 64;
+    if (rows == 0) rows = 1;
+
+    try
+    {
+        heap_map map;
+        if (path != nullptr)
+        {
+            std::ifstream file(path);
+            if (!file)
+                throw std::runtime_error("cannot open " + std::string(path));
+            map = read_map(file);
+        }
+        else
+        {
+            map = read_map(std::cin);
+        }
+        if (map.size == 0) throw std::runtime_error("empty memory");
+
+        if (svg)
+        {
+            print_svg(map, width, rows, std::cout);
+            print_stats(map, std::cerr);
+        }
+        else
+        {
+            print_ascii(map, width, rows, std::cout);
+            print_stats(map, std::cout);
+        }
+    }
+    catch (const std::exception& e)
+    {
+        std::cerr << "heap_map: " << e.what() << '\n';
+        return 1;
+    }
+    return 0;
+}